@@ -0,0 +1,307 @@
+/*
+ * exec-storm - measure the latency of fork+exec.
+ *
+ * A number of threads each repeatedly spawn the given command, and wait
+ * for it to exit, timing each iteration.  Once they're all done the
+ * latency percentiles, and overall rate, are reported as a single line:
+ *
+ *   RESULT module=hashcheck workload=tiny cache=warm threads=8 execs=80000 ...
+ *
+ * Usage:
+ *
+ *   exec-storm [-j threads] [-n iterations] [-u uid] [-c] [-l label] -- cmd [args]
+ *
+ * -j  The number of threads to run, default 1.
+ * -n  The number of executions each thread performs, default 1000.
+ * -u  Run the command as the given UID; root is never checked by the
+ *     modules so this is usually required.
+ * -c  Cold-cache mode: drop the page, dentry and inode caches before every
+ *     execution.  The time taken to drop the caches isn't counted.  This
+ *     forces a single thread, and requires that we're started as root.
+ *     The command is still run as the UID given by -u.
+ * -l  A label to include in the output, e.g. "module=whitelist workload=tiny".
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+
+extern char **environ;
+
+static int threads = 1;
+static long iterations = 1000;
+static int cold = 0;
+static int child_uid = -1;
+static char **command;
+
+/*
+ * State for each thread.
+ */
+struct worker
+{
+    pthread_t thread;
+    long *samples;
+    long count;
+    long failures;
+};
+
+
+/*
+ * Current time, in nanoseconds.
+ */
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Drop the page, dentry and inode caches.
+ *
+ * Dropping the inodes also discards any verdicts cached by the modules.
+ */
+static void drop_caches(void)
+{
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+    sync();
+
+    if (fd < 0 || write(fd, "3", 1) != 1)
+    {
+        perror("drop_caches");
+        exit(1);
+    }
+
+    close(fd);
+}
+
+/*
+ * Spawn the command, and wait for it to complete.
+ *
+ * Normally we've already switched UID and use posix_spawn(), but in
+ * cold-cache mode we remain root and switch UID in the child.
+ *
+ * Returns 0 if it executed and exited successfully.
+ */
+static int run_once(void)
+{
+    pid_t pid;
+    int status;
+
+    if (child_uid >= 0)
+    {
+        pid = fork();
+
+        if (pid < 0)
+            return -1;
+
+        if (pid == 0)
+        {
+            if (setgid(child_uid) == 0 && setuid(child_uid) == 0)
+                execve(command[0], command, environ);
+
+            _exit(127);
+        }
+    }
+    else if (posix_spawn(&pid, command[0], NULL, NULL, command, environ) != 0)
+    {
+        return -1;
+    }
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+        long start;
+
+        if (cold)
+            drop_caches();
+
+        start = now_ns();
+
+        if (run_once() != 0)
+        {
+            w->failures++;
+            continue;
+        }
+
+        w->samples[w->count++] = now_ns() - start;
+    }
+
+    return NULL;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * The given percentile of the sorted samples, in microseconds.
+ */
+static double percentile(const long *samples, long count, double pct)
+{
+    long idx;
+
+    if (count == 0)
+        return 0;
+
+    idx = (long)(pct / 100.0 * (count - 1) + 0.5);
+    return samples[idx] / 1000.0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-n iterations] [-u uid] [-c] [-l label] -- cmd [args]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *workers;
+    const char *label = "";
+    long *all;
+    long total = 0;
+    long failures = 0;
+    long start, elapsed;
+    int uid = -1;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "j:n:u:cl:")) != -1)
+    {
+        switch (c)
+        {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'u':
+            uid = atoi(optarg);
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc || threads < 1 || iterations < 1)
+        usage(argv[0]);
+
+    command = &argv[optind];
+
+    //
+    // Dropping caches needs root, and takes a global lock, so cold-cache
+    // runs are single-threaded.
+    //
+    if (cold)
+    {
+        threads = 1;
+        child_uid = uid;
+    }
+    else if (uid >= 0 && (setgid(uid) != 0 || setuid(uid) != 0))
+    {
+        perror("setuid");
+        return 1;
+    }
+
+    //
+    // Make sure we can run the command at all, before timing anything.
+    //
+    if (run_once() != 0)
+    {
+        fprintf(stderr, "Failed to execute %s\n", command[0]);
+        return 1;
+    }
+
+    workers = calloc(threads, sizeof(*workers));
+    all = malloc(sizeof(long) * threads * iterations);
+
+    if (!workers || !all)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (i = 0; i < threads; i++)
+        workers[i].samples = all + (long)i * iterations;
+
+    start = now_ns();
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    elapsed = now_ns() - start;
+
+    //
+    // Gather all the samples together, then sort them.
+    //
+    for (i = 0; i < threads; i++)
+    {
+        memmove(all + total, workers[i].samples, sizeof(long) * workers[i].count);
+        total += workers[i].count;
+        failures += workers[i].failures;
+    }
+
+    qsort(all, total, sizeof(long), compare_long);
+
+    printf("RESULT %s cache=%s threads=%d execs=%ld failures=%ld seconds=%.3f rate=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+           label, cold ? "cold" : "warm", threads, total, failures,
+           elapsed / 1e9, total / (elapsed / 1e9),
+           percentile(all, total, 50), percentile(all, total, 99),
+           percentile(all, total, 100));
+
+    free(all);
+    free(workers);
+    return failures ? 2 : 0;
+}
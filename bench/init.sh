@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# /init within the benchmark initramfs.
+#
+# Label the payloads so that every module will permit them, then run each
+# workload and print the RESULT lines to the console, before powering off.
+#
+
+export PATH=/bin:/sbin
+
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t securityfs securityfs /sys/kernel/security
+mount -t devtmpfs devtmpfs /dev
+mkdir -p /bench
+mount -t ext4 /dev/vda /bench
+
+# The module under test, from the kernel command-line.
+module=$(sed -n 's/.*bench\.module=\([^ ]*\).*/\1/p' /proc/cmdline)
+threads=$(sed -n 's/.*bench\.threads=\([^ ]*\).*/\1/p' /proc/cmdline)
+iterations=$(sed -n 's/.*bench\.iterations=\([^ ]*\).*/\1/p' /proc/cmdline)
+
+[ -z "$module" ] && module=none
+[ -z "$threads" ] && threads=$(nproc)
+[ -z "$iterations" ] && iterations=2000
+
+echo "LSM: $(cat /sys/kernel/security/lsm)"
+
+#
+# whitelist & hashcheck: label everything we'll execute.
+#
+for i in /bench/payloads/* /bench/lib/* /bin/busybox; do
+    xattr-set security.whitelisted 1 $i
+    xattr-set security.hash 0x0101$(sha1sum $i | cut -d' ' -f1) $i
+done
+
+#
+# can-exec: allow `nobody` to run the payloads.
+#
+mkdir -p /etc/can-exec
+ls /bench/payloads/* > /etc/can-exec/nobody.conf
+echo /bin/busybox >> /etc/can-exec/nobody.conf
+if [ "$module" = "can-exec" ]; then
+    echo 1 > /proc/sys/kernel/can-exec/enabled
+fi
+
+#
+# Run the given workloads, labelling the results with the given module.
+#
+run_workloads() {
+    name=$1
+    shift
+
+    for workload in "$@"; do
+        label="module=$name workload=$workload"
+        cmd=/bench/payloads/$workload
+
+        # Warm cache: one thread, then all of them.
+        exec-storm -u 65534 -j 1 -n $iterations -l "$label" -- $cmd
+        exec-storm -u 65534 -j $threads -n $iterations -l "$label" -- $cmd
+
+        # Cold cache, with the page-cache and inodes dropped before each run.
+        exec-storm -u 65534 -c -n 20 -l "$label" -- $cmd
+    done
+}
+
+run_workloads $module tiny medium huge script dynamic
+
+#
+# hashcheck: start the dynamic payload again, with the dynamic linker and
+# the C library checked as they're mapped.
+#
+if [ "$module" = "hashcheck" ]; then
+    echo 1 > /proc/sys/kernel/hashcheck/mmap
+    run_workloads hashcheck-mmap dynamic
+
+    #
+    # A file which is open for writing can't be mapped executable if it
+    # must be hashed, but one without a label is denied as usual.
+    #
+    cp /bench/payloads/tiny /bench/unlabelled
+    cp /bench/payloads/tiny /bench/labelled
+    xattr-set security.hash 0x0101$(sha1sum /bench/labelled | cut -d' ' -f1) /bench/labelled
+
+    mmap-check -u 65534 -w -l "hashcheck-mmap unlabelled-writer" EPERM /bench/unlabelled
+    mmap-check -u 65534 -w -l "hashcheck-mmap labelled-writer" ETXTBSY /bench/labelled
+    mmap-check -u 65534 -l "hashcheck-mmap labelled" ok /bench/labelled
+fi
+
+echo "BENCHMARK COMPLETE"
+poweroff -f
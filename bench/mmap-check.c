@@ -0,0 +1,132 @@
+/*
+ * mmap-check - check how mapping a file executable is decided.
+ *
+ * Maps the given file with PROT_EXEC, as the given UID, optionally while
+ * the file is held open for writing, and compares the outcome with that
+ * expected, reporting a single line:
+ *
+ *   CHECK hashcheck-mmap unlabelled-writer expect=EPERM got=EPERM pass
+ *
+ * Usage:
+ *
+ *   mmap-check [-w] [-u uid] [-l label] EXPECT FILE
+ *
+ * -w  Hold the file open for writing while it is mapped.
+ * -u  Map the file as the given UID; root is never checked by the modules.
+ * -l  A label to include in the output.
+ *
+ * EXPECT is `ok`, or the name of the errno the mapping should fail with,
+ * one of EPERM, EACCES or ETXTBSY.  The exit status is non-zero if the
+ * outcome differs.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+
+static const char *outcome(int err)
+{
+    switch (err)
+    {
+    case 0:
+        return "ok";
+    case EPERM:
+        return "EPERM";
+    case EACCES:
+        return "EACCES";
+    case ETXTBSY:
+        return "ETXTBSY";
+    }
+
+    return strerror(err);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *label = "mmap";
+    int writer = -1;
+    int write_flag = 0;
+    uid_t uid = 0;
+    void *map;
+    int err = 0;
+    int fd;
+    int c;
+
+    while ((c = getopt(argc, argv, "wu:l:")) != -1)
+    {
+        switch (c)
+        {
+        case 'w':
+            write_flag = 1;
+            break;
+        case 'u':
+            uid = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w] [-u uid] [-l label] EXPECT FILE\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s [-w] [-u uid] [-l label] EXPECT FILE\n", argv[0]);
+        return 1;
+    }
+
+    //
+    // Open the file for writing before giving up root, as `nobody` can't.
+    //
+    if (write_flag && (writer = open(argv[optind + 1], O_WRONLY)) < 0)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    if (uid && (setresgid(uid, uid, uid) != 0 || setresuid(uid, uid, uid) != 0))
+    {
+        perror("setresuid");
+        return 1;
+    }
+
+    fd = open(argv[optind + 1], O_RDONLY);
+
+    if (fd < 0)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    map = mmap(NULL, 4096, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED)
+        err = errno;
+    else
+        munmap(map, 4096);
+
+    close(fd);
+
+    if (writer >= 0)
+        close(writer);
+
+    int pass = strcmp(outcome(err), argv[optind]) == 0;
+
+    printf("CHECK %s expect=%s got=%s %s\n", label, argv[optind], outcome(err),
+           pass ? "pass" : "FAIL");
+
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Summarise RESULT lines, showing the overhead of each module relative
+# to the `module=none` baseline for the same workload, cache and threads.
+#
+# Usage:
+#
+#   ./report.sh results.txt
+#
+
+awk '
+/^RESULT/ {
+    delete f
+    for (i = 2; i <= NF; i++) {
+        split($i, kv, "=")
+        f[kv[1]] = kv[2]
+    }
+
+    key = f["workload"] " " f["cache"] " " f["threads"]
+    row = f["module"] SUBSEP key
+
+    if (!(key in seen)) {
+        seen[key] = 1
+        keys[++nkeys] = key
+    }
+    if (!(f["module"] in mseen)) {
+        mseen[f["module"]] = 1
+        modules[++nmodules] = f["module"]
+    }
+
+    p50[row] = f["p50_us"]
+    p99[row] = f["p99_us"]
+    rate[row] = f["rate"]
+}
+
+END {
+    printf "%-14s %-8s %-6s %-8s %10s %10s %12s %10s\n", "module", "workload", "cache", "threads", "p50_us", "p99_us", "execs/sec", "p50 cost"
+    for (k = 1; k <= nkeys; k++) {
+        split(keys[k], parts, " ")
+        base = "none" SUBSEP keys[k]
+        for (m = 1; m <= nmodules; m++) {
+            row = modules[m] SUBSEP keys[k]
+            if (!(row in p50))
+                continue
+            cost = "-"
+            if (modules[m] != "none" && (base in p50) && p50[base] > 0)
+                cost = sprintf("%+.1f%%", (p50[row] / p50[base] - 1) * 100)
+            printf "%-14s %-8s %-6s %-8s %10s %10s %12s %10s\n", modules[m], parts[1], parts[2], parts[3], p50[row], p99[row], rate[row], cost
+        }
+    }
+}' "$@"
@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# Boot a kernel under QEMU/KVM once per module, run the exec-storm
+# workloads within it, and report the results against the baseline.
+#
+# Usage:
+#
+#   ./run-qemu.sh /path/to/bzImage [module ..]
+#
+# The kernel must be built with all three modules, along with ext4 and
+# virtio-blk.  Each boot enables a single module via `lsm=`, and the
+# module `none` is the baseline with none of them.  The default is to
+# run `none whitelist hashcheck can-exec`.
+#
+# The following environment variables are honoured:
+#
+#   BUSYBOX     A statically-linked busybox, default `which busybox`.
+#   CPUS        Number of virtual CPUs, default `nproc`.
+#   MEMORY      Guest memory, default 4G.
+#   ITERATIONS  Executions per thread, default 2000.
+#
+# Every RESULT and CHECK line is appended to results.txt.
+#
+
+set -e
+
+KERNEL=$1
+shift || true
+
+if [ -z "$KERNEL" ] || [ ! -f "$KERNEL" ]; then
+    echo "Usage: $0 /path/to/bzImage [module ..]" >&2
+    exit 1
+fi
+
+MODULES=${*:-none whitelist hashcheck can-exec}
+BUSYBOX=${BUSYBOX:-$(which busybox)}
+CPUS=${CPUS:-$(nproc)}
+MEMORY=${MEMORY:-4G}
+ITERATIONS=${ITERATIONS:-2000}
+
+cd "$(dirname "$0")"
+make all
+
+#
+# The initramfs holds busybox, our tools, and the can-exec helper.
+#
+rm -rf initramfs
+mkdir -p initramfs/bin initramfs/sbin initramfs/etc initramfs/proc \
+         initramfs/sys initramfs/dev
+cp "$BUSYBOX" initramfs/bin/busybox
+for cmd in $(initramfs/bin/busybox --list); do
+    ln -sf busybox initramfs/bin/$cmd
+done
+cp exec-storm xattr-set mmap-check initramfs/bin/
+cp can-exec initramfs/sbin/can-exec
+cp init.sh initramfs/init
+echo "root:x:0:0:root:/:/bin/sh" > initramfs/etc/passwd
+echo "nobody:x:65534:65534:nobody:/:/bin/false" >> initramfs/etc/passwd
+(cd initramfs && find . | cpio -o -H newc --quiet | gzip -9) > initramfs.cpio.gz
+
+#
+# The payloads live upon a real disk, so that cold-cache runs read them.
+#
+rm -rf disk.img disk-root
+mkdir -p disk-root
+cp -a payloads lib disk-root/
+mkfs.ext4 -q -F -d disk-root disk.img 256M
+
+for module in $MODULES; do
+    if [ "$module" = "none" ]; then
+        lsm="capability"
+    else
+        lsm="capability,exec_policy,$module"
+    fi
+
+    qemu-system-x86_64 -enable-kvm -cpu host -smp "$CPUS" -m "$MEMORY" \
+        -kernel "$KERNEL" -initrd initramfs.cpio.gz \
+        -drive file=disk.img,if=virtio,format=raw \
+        -append "console=ttyS0 quiet panic=-1 lsm=$lsm bench.module=$module bench.threads=$CPUS bench.iterations=$ITERATIONS" \
+        -nographic -no-reboot | tr -d '\r' | tee "boot-$module.log" | grep '^RESULT\|^CHECK' | tee -a results.txt
+done
+
+./report.sh results.txt
@@ -0,0 +1,7 @@
+/*
+ * The smallest useful payload: exit successfully.
+ */
+int main(void)
+{
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * xattr-set - set an extended attribute upon some files.
+ *
+ * Usage:
+ *
+ *   xattr-set NAME VALUE FILE [FILE..]
+ *
+ * If VALUE begins with `0x` it is decoded from hex, as setfattr does,
+ * which allows binary values such as those used by hashcheck.
+ *
+ * This exists because busybox has no setfattr.
+ *
+ * Steve
+ * --
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    char value[1024];
+    size_t len;
+    int rc = 0;
+    int i;
+
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s NAME VALUE FILE [FILE..]\n", argv[0]);
+        return 1;
+    }
+
+    if (strncmp(argv[2], "0x", 2) == 0)
+    {
+        const char *hex = argv[2] + 2;
+
+        if (strlen(hex) % 2 != 0 || strlen(hex) / 2 > sizeof(value))
+        {
+            fprintf(stderr, "Invalid hex value\n");
+            return 1;
+        }
+
+        for (len = 0; hex[len * 2]; len++)
+        {
+            int hi = hex_value(hex[len * 2]);
+            int lo = hex_value(hex[len * 2 + 1]);
+
+            if (hi < 0 || lo < 0)
+            {
+                fprintf(stderr, "Invalid hex value\n");
+                return 1;
+            }
+
+            value[len] = (hi << 4) | lo;
+        }
+    }
+    else
+    {
+        len = strlen(argv[2]);
+
+        if (len > sizeof(value))
+        {
+            fprintf(stderr, "Value too long\n");
+            return 1;
+        }
+
+        memcpy(value, argv[2], len);
+    }
+
+    for (i = 3; i < argc; i++)
+    {
+        if (setxattr(argv[i], argv[1], value, len, 0) != 0)
+        {
+            perror(argv[i]);
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
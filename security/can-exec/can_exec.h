@@ -0,0 +1,101 @@
+/*
+ * can_exec.h - Steve Kemp
+ *
+ * The protocol spoken between the can-exec LSM and a policy daemon,
+ * over the file:
+ *
+ *      /sys/kernel/security/can-exec/channel
+ *
+ * The daemon reads a batch of requests, each a `struct can_exec_request`,
+ * and answers each by writing a `struct can_exec_reply` with the same id.
+ * Requests may be answered in any order, and replies may be batched.
+ *
+ * It also describes the compiled policy which may be written to:
+ *
+ *      /sys/kernel/security/can-exec/policy
+ *
+ * This header is shared with the user-space tools in samples/.
+ *
+ */
+
+#ifndef _CAN_EXEC_H
+#define _CAN_EXEC_H
+
+#include <linux/types.h>
+
+#define CAN_EXEC_PATH_MAX 4096
+
+#define CAN_EXEC_REQUEST_LOCAL_PATH 0x01
+
+/*
+ * A request for a verdict.
+ *
+ * `dev`, `ino` and `version` identify the binary being executed, so
+ * that a daemon can recognise it regardless of the path used to reach
+ * it.  `dev` is encoded as in `st_dev`, and `version` is the inode's
+ * i_version, which changes whenever the binary is modified.
+ *
+ * `path` is the full path of the binary, including the mount-point it
+ * lives beneath, from the root of the initial mount namespace.  It is
+ * NUL-terminated, and `path_len` excludes the terminator.  Bytes following
+ * the terminator are undefined.
+ *
+ * If `flags` has CAN_EXEC_REQUEST_LOCAL_PATH set the executing task is in
+ * another mount namespace, or the binary can't be reached from the root
+ * at all, and the path is only what the task itself sees.  Such a path
+ * may have been arranged to name any file, so must not be trusted without
+ * checking it leads to `dev` and `ino`.
+ */
+struct can_exec_request
+{
+    __u64 id;
+    __u32 uid;
+    __u32 gid;
+    __u64 dev;
+    __u64 ino;
+    __u64 version;
+    __u32 path_len;
+    __u32 flags;
+    char  path[CAN_EXEC_PATH_MAX];
+};
+
+/*
+ * A verdict: 0 permits the execution, anything else denies it.
+ */
+struct can_exec_reply
+{
+    __u64 id;
+    __s32 verdict;
+    __u32 reserved;
+};
+
+/*
+ * A compiled policy is a header, followed by `uids` __u32 values - the
+ * users the policy covers - and then `rules` records, each padded to a
+ * multiple of four bytes.
+ *
+ * A user listed in the policy may execute exactly the paths given by
+ * the rules for that user.  Users who aren't listed are still decided by
+ * the daemon, or the helper.
+ */
+#define CAN_EXEC_POLICY_MAGIC   0x50584543      /* "CEXP" */
+#define CAN_EXEC_POLICY_VERSION 1
+
+struct can_exec_policy_header
+{
+    __u32 magic;
+    __u32 version;
+    __u32 uids;
+    __u32 rules;
+};
+
+/*
+ * `path_len` bytes of path, without a terminator, follow each rule.
+ */
+struct can_exec_policy_rule
+{
+    __u32 uid;
+    __u32 path_len;
+};
+
+#endif
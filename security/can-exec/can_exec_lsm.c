@@ -21,63 +21,1609 @@
  *
  *  * The complete path, but not arguments, to the binary the user is invoking
  *
+ * If the invoking task is outside the initial mount namespace the path is
+ * only what that task sees, and may name a different file entirely, so a
+ * third argument of the form `DEV:INO` follows.  The helper must check the
+ * path leads to that device and inode before trusting it.
+ *
  * The user-space helper should return an exit-code of `0` if the execution
  * should be permitted, otherwise it will be denied.
  *
+ * Policy Daemon
+ * -------------
+ *
+ * Running a helper for every execution is expensive, so instead a long-lived
+ * daemon may open:
+ *
+ *      /sys/kernel/security/can-exec/channel
+ *
+ * While it is open each execution is queued as a request, which the daemon
+ * reads and answers, using the protocol described in `can_exec.h`.  Many
+ * requests may be outstanding at once.  If no daemon is running, or it goes
+ * away, the user-space helper is used as before.
+ *
+ * Compiled Policy
+ * ---------------
+ *
+ * Simple allow-lists may be compiled, by `can-exec-compile`, and written to:
+ *
+ *      /sys/kernel/security/can-exec/policy
+ *
+ * Users covered by the compiled policy are then decided in the kernel,
+ * with no round-trip to user-space.  Reading the file reports how many
+ * users and rules are loaded.  Rules are matched against the path from
+ * the root of the initial mount namespace, ignoring any chroot, and tasks
+ * in any other mount namespace are always sent to user-space, as there an
+ * unprivileged user may mount anything at an allowed path.
+ *
+ * Scope
+ * -----
+ *
+ * By default every execution is checked.  Enforcement may instead be
+ * limited to some users, and/or some cgroup v2 subtrees, by writing
+ * lines like these to:
+ *
+ *      /sys/kernel/security/can-exec/scope
+ *
+ *      uid 1000-59999
+ *      cgroup /user.slice
+ *
+ * Executions outside the scope are allowed at once, before anything
+ * else is done.
+ *
+ * Verdict Cache
+ * -------------
+ *
+ * Verdicts are remembered for each (uid, device, inode, i_version), so a
+ * user running the same binary repeatedly only asks user-space once.  They
+ * expire after the number of seconds in:
+ *
+ *      /proc/sys/kernel/can-exec/cache_ttl
+ *
+ * A TTL of `0` disables the cache.  After editing the policy the cache
+ * should be flushed, by writing `1` to:
+ *
+ *      /proc/sys/kernel/can-exec/cache_flush
+ *
+ * Statistics
+ * ----------
+ *
+ * Counts of checks, verdicts, errors and cache hits, and how long each
+ * check took, may be read from:
+ *
+ *      /sys/kernel/security/can-exec/stats
+ *
+ * Timeouts
+ * --------
+ *
+ * A daemon or helper which hangs would otherwise stall every execution.
+ * If a deadline, in milliseconds, is written to:
+ *
+ *      /proc/sys/kernel/can-exec/timeout
+ *
+ * then a late daemon is given up upon, and a late helper is killed, and
+ * the execution is allowed or denied according to:
+ *
+ *      /proc/sys/kernel/can-exec/timeout_verdict
+ *
+ * where `1`, the default, denies.  The deadline covers the whole check, so
+ * a helper run because the daemon went away only gets what time is left.
+ * How long round-trips take is reported in
+ * /sys/kernel/security/can-exec/latency, to help choose a deadline.
+ *
  * Steve
  * --
  *
  */
 
-#include <linux/xattr.h>
-#include <linux/binfmts.h>
-#include <linux/lsm_hooks.h>
-#include <linux/sysctl.h>
-#include <linux/string_helpers.h>
-#include <linux/lsm_hooks.h>
-#include <linux/types.h>
-#include <linux/cred.h>
-#include <linux/module.h>
-#include <linux/init.h>
-#include <linux/kmod.h>
+#include <linux/xattr.h>
+#include <linux/binfmts.h>
+#include <linux/lsm_hooks.h>
+#include <linux/sysctl.h>
+#include <linux/string_helpers.h>
+#include <linux/lsm_hooks.h>
+#include <linux/types.h>
+#include <linux/cred.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/kmod.h>
+#include <linux/security.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/pid.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
+#include <linux/iversion.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/kdev_t.h>
+#include <linux/dcache.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/bitmap.h>
+#include <linux/cgroup.h>
+#include <linux/ctype.h>
+#include <linux/nsproxy.h>
+#include <linux/sched/task.h>
+
+#include "can_exec.h"
+#include "../lsm_stats.h"
+#include "../exec_policy.h"
+
+
+//
+// Is this module enabled?
+//
+// Controlled via /proc/sys/kernel/can-exec/enabled
+//
+static int can_exec_enabled = 0;
+
+//
+// How long, in seconds, cached verdicts remain valid.
+//
+// Controlled via /proc/sys/kernel/can-exec/cache_ttl
+//
+static int can_exec_cache_ttl = 60;
+static int can_exec_cache_ttl_max = 86400;
+
+//
+// Written to flush the cache, via /proc/sys/kernel/can-exec/cache_flush
+//
+static int can_exec_cache_flush;
+
+//
+// Statistics, reported via /sys/kernel/security/can-exec/stats
+//
+DEFINE_LSM_STATS(can_exec_stats);
+
+//
+// How long, in milliseconds, we'll wait for the daemon or helper before
+// giving up, and the verdict we return when we do: 0 allows, 1 denies.
+//
+// Controlled via /proc/sys/kernel/can-exec/timeout, where `0` waits
+// forever, and /proc/sys/kernel/can-exec/timeout_verdict.
+//
+static int can_exec_timeout = 0;
+static int can_exec_timeout_max = 600000;
+static int can_exec_timeout_verdict = 1;
+
+//
+// How much longer, in jiffies, an execution which started waiting at
+// `start` may wait: 0 once its time is up, or MAX_SCHEDULE_TIMEOUT if
+// there's no limit.
+//
+// Every wait for a single execution is timed against the same deadline.
+//
+static long can_exec_time_left(unsigned long start)
+{
+    unsigned long timeout = msecs_to_jiffies(READ_ONCE(can_exec_timeout));
+
+    if (!timeout)
+        return MAX_SCHEDULE_TIMEOUT;
+
+    if (time_after_eq(jiffies, start + timeout))
+        return 0;
+
+    return start + timeout - jiffies;
+}
+
+
+//
+// Scratch space used to build a request.
+//
+// There is one of these per CPU, allocated once when we start.  It is only
+// used with preemption disabled, to resolve the path and consult the
+// compiled policy, neither of which sleeps, so most executions never need
+// to allocate anything.
+//
+// A request which must wait for the daemon, or the helper, is built again
+// in memory of its own, from can_exec_request_cache, which its task owns
+// until it has a verdict.  Any number of those may be outstanding at once.
+//
+static DEFINE_PER_CPU(struct can_exec_request *, can_exec_scratch);
+
+static struct kmem_cache *can_exec_request_cache;
+
+//
+// Is the current task within the initial mount namespace?
+//
+// Outside of it an unprivileged user may build whatever tree they like,
+// with a user namespace, so any binary could appear at an allowed path.
+//
+static bool can_exec_in_init_mnt_ns(void)
+{
+    return current->nsproxy->mnt_ns == init_task.nsproxy->mnt_ns;
+}
+
+//
+// Describe the execution of the given file, by the given user, in `req`.
+//
+// Within the initial mount namespace the path comes from d_absolute_path(),
+// so it is relative to that namespace's root and ignores any chroot - the
+// path as the administrator sees it.  Otherwise, or if the file can't be
+// reached from the root at all, such as a memfd, we use d_path() and flag
+// the path as meaningful only to the task itself.  Such a path is never
+// matched against the compiled policy, and the daemon and helper must check
+// it leads to `dev` and `ino` before trusting it.
+//
+// Both build the name at the end of the buffer, so we move it to the start
+// afterwards.
+//
+static int can_exec_request_init(struct can_exec_request *req,
+                                 const struct cred *cred, struct file *file)
+{
+    struct inode *inode = file_inode(file);
+    char *path = ERR_PTR(-EINVAL);
+
+    req->id = 0;
+    req->uid = cred->uid.val;
+    req->gid = cred->gid.val;
+    req->dev = huge_encode_dev(inode->i_sb->s_dev);
+    req->ino = inode->i_ino;
+    req->version = inode_query_iversion(inode);
+    req->flags = 0;
+
+    if (can_exec_in_init_mnt_ns())
+        path = d_absolute_path(&file->f_path, req->path, sizeof(req->path));
+
+    if (path == ERR_PTR(-EINVAL))
+    {
+        req->flags |= CAN_EXEC_REQUEST_LOCAL_PATH;
+        path = d_path(&file->f_path, req->path, sizeof(req->path));
+    }
+
+    if (IS_ERR(path))
+        return PTR_ERR(path);
+
+    req->path_len = req->path + sizeof(req->path) - 1 - path;
+    memmove(req->path, path, req->path_len + 1);
+    return 0;
+}
+
+
+//
+// A cached verdict.
+//
+// The change time is part of the key too, as not every filesystem
+// maintains i_version.
+//
+struct can_exec_cache_key
+{
+    uid_t uid;
+    dev_t dev;
+    unsigned long ino;
+    u64 version;
+    struct timespec64 ctime;
+};
+
+struct can_exec_cache_entry
+{
+    struct hlist_node node;
+    struct list_head age;
+    struct rcu_head rcu;
+    struct can_exec_cache_key key;
+    unsigned long expires;
+    int verdict;
+};
+
+#define CAN_EXEC_CACHE_BITS 10
+#define CAN_EXEC_CACHE_MAX  4096
+
+//
+// Lookups are lockless, under RCU.  Insertion and removal take the lock,
+// and entries are kept upon the `age` list, oldest first, so that we can
+// discard the oldest once we've reached CAN_EXEC_CACHE_MAX entries.
+//
+// The generation is bumped upon every flush, so that verdicts which were
+// being calculated at the time aren't then stored.
+//
+static DEFINE_HASHTABLE(can_exec_cache, CAN_EXEC_CACHE_BITS);
+static DEFINE_SPINLOCK(can_exec_cache_lock);
+static LIST_HEAD(can_exec_cache_age);
+static unsigned int can_exec_cache_count;
+static unsigned int can_exec_cache_gen;
+
+
+static void can_exec_cache_key_init(struct can_exec_cache_key *key, kuid_t uid,
+                                    struct inode *inode)
+{
+    memset(key, 0, sizeof(*key));
+    key->uid = uid.val;
+    key->dev = inode->i_sb->s_dev;
+    key->ino = inode->i_ino;
+    key->version = inode_query_iversion(inode);
+    key->ctime = inode->i_ctime;
+}
+
+static u32 can_exec_cache_hash(const struct can_exec_cache_key *key)
+{
+    return jhash(key, sizeof(*key), 0);
+}
+
+//
+// Look for a cached verdict, returning true if one was found.
+//
+static bool can_exec_cache_lookup(const struct can_exec_cache_key *key, int *verdict)
+{
+    struct can_exec_cache_entry *entry;
+    bool found = false;
+
+    if (READ_ONCE(can_exec_cache_ttl) <= 0)
+        return false;
+
+    rcu_read_lock();
+
+    hash_for_each_possible_rcu(can_exec_cache, entry, node, can_exec_cache_hash(key))
+    {
+        if (memcmp(&entry->key, key, sizeof(*key)) == 0 &&
+            time_before(jiffies, entry->expires))
+        {
+            *verdict = entry->verdict;
+            found = true;
+            break;
+        }
+    }
+
+    rcu_read_unlock();
+
+    lsm_stats_inc(&can_exec_stats, found ? LSM_STAT_CACHE_HITS : LSM_STAT_CACHE_MISSES);
+    return found;
+}
+
+//
+// Called with can_exec_cache_lock held.
+//
+static void can_exec_cache_remove(struct can_exec_cache_entry *entry)
+{
+    hash_del_rcu(&entry->node);
+    list_del(&entry->age);
+    can_exec_cache_count--;
+    kfree_rcu(entry, rcu);
+}
+
+//
+// Remember a verdict, unless the cache was flushed since generation `gen`.
+//
+static void can_exec_cache_store(const struct can_exec_cache_key *key,
+                                 unsigned int gen, int verdict)
+{
+    struct can_exec_cache_entry *entry, *old;
+    int ttl = READ_ONCE(can_exec_cache_ttl);
+
+    if (ttl <= 0)
+        return;
+
+    entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+
+    if (!entry)
+        return;
+
+    entry->key = *key;
+    entry->expires = jiffies + (unsigned long)ttl * HZ;
+    entry->verdict = verdict;
+
+    spin_lock(&can_exec_cache_lock);
+
+    if (gen != can_exec_cache_gen)
+    {
+        spin_unlock(&can_exec_cache_lock);
+        kfree(entry);
+        return;
+    }
+
+    //
+    // Replace any expired entry for the same key.
+    //
+    hash_for_each_possible(can_exec_cache, old, node, can_exec_cache_hash(key))
+    {
+        if (memcmp(&old->key, key, sizeof(*key)) == 0)
+        {
+            can_exec_cache_remove(old);
+            break;
+        }
+    }
+
+    if (can_exec_cache_count >= CAN_EXEC_CACHE_MAX)
+    {
+        old = list_first_entry(&can_exec_cache_age, struct can_exec_cache_entry, age);
+        can_exec_cache_remove(old);
+    }
+
+    hash_add_rcu(can_exec_cache, &entry->node, can_exec_cache_hash(key));
+    list_add_tail(&entry->age, &can_exec_cache_age);
+    can_exec_cache_count++;
+
+    spin_unlock(&can_exec_cache_lock);
+}
+
+static unsigned int can_exec_cache_generation(void)
+{
+    unsigned int gen;
+
+    spin_lock(&can_exec_cache_lock);
+    gen = can_exec_cache_gen;
+    spin_unlock(&can_exec_cache_lock);
+
+    return gen;
+}
+
+//
+// Discard every cached verdict.
+//
+static void can_exec_cache_flush_all(void)
+{
+    struct can_exec_cache_entry *entry, *tmp;
+
+    spin_lock(&can_exec_cache_lock);
+
+    can_exec_cache_gen++;
+
+    list_for_each_entry_safe(entry, tmp, &can_exec_cache_age, age)
+        can_exec_cache_remove(entry);
+
+    spin_unlock(&can_exec_cache_lock);
+}
+
+//
+// Handle writes to /proc/sys/kernel/can-exec/cache_flush.
+//
+static int can_exec_cache_flush_handler(struct ctl_table *table, int write,
+                                        void *buffer, size_t *lenp, loff_t *ppos)
+{
+    int ret = proc_dointvec(table, write, buffer, lenp, ppos);
+
+    if (ret == 0 && write)
+        can_exec_cache_flush_all();
+
+    return ret;
+}
+
+
+//
+// The compiled policy.
+//
+// Both tables are sized when the policy is loaded, and the whole policy
+// is replaced at once, so lookups need nothing more than RCU.
+//
+struct can_exec_policy_user
+{
+    struct hlist_node node;
+    uid_t uid;
+};
+
+struct can_exec_policy_path
+{
+    struct hlist_node node;
+    uid_t uid;
+    u32 hash;
+    u32 len;
+    char path[];
+};
+
+struct can_exec_policy
+{
+    unsigned int user_bits;
+    unsigned int path_bits;
+    unsigned int users;
+    unsigned int paths;
+    struct hlist_head *user_table;
+    struct hlist_head *path_table;
+};
+
+//
+// The largest policy we'll accept, and the most buckets we'll use.
+//
+#define CAN_EXEC_POLICY_MAX      (16 * 1024 * 1024)
+#define CAN_EXEC_POLICY_MAX_BITS 20
+
+static struct can_exec_policy __rcu *can_exec_policy;
+static DEFINE_MUTEX(can_exec_policy_mutex);
+
+
+static u32 can_exec_policy_hash(uid_t uid, const char *path, u32 len)
+{
+    return jhash(path, len, uid);
+}
+
+//
+// Look up the given user, and path, in the compiled policy.
+//
+// Returns 0 to allow, -EPERM to deny, or -ENOENT if the user isn't covered.
+//
+static int can_exec_policy_check(kuid_t uid, const char *path, u32 len)
+{
+    struct can_exec_policy *policy;
+    struct can_exec_policy_user *user;
+    struct can_exec_policy_path *entry;
+    u32 hash;
+    int ret = -ENOENT;
+
+    rcu_read_lock();
+
+    policy = rcu_dereference(can_exec_policy);
+
+    if (!policy)
+        goto out;
+
+    hlist_for_each_entry_rcu(user, &policy->user_table[hash_32(uid.val, policy->user_bits)], node)
+    {
+        if (user->uid == uid.val)
+        {
+            ret = -EPERM;
+            break;
+        }
+    }
+
+    if (ret == -ENOENT)
+        goto out;
+
+    hash = can_exec_policy_hash(uid.val, path, len);
+
+    hlist_for_each_entry_rcu(entry, &policy->path_table[hash_32(hash, policy->path_bits)], node)
+    {
+        if (entry->hash == hash && entry->uid == uid.val &&
+            entry->len == len && memcmp(entry->path, path, len) == 0)
+        {
+            ret = 0;
+            break;
+        }
+    }
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void can_exec_policy_free(struct can_exec_policy *policy)
+{
+    struct can_exec_policy_user *user;
+    struct can_exec_policy_path *entry;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    if (!policy)
+        return;
+
+    if (policy->user_table)
+    {
+        for (i = 0; i < (1U << policy->user_bits); i++)
+            hlist_for_each_entry_safe(user, tmp, &policy->user_table[i], node)
+                kfree(user);
+    }
+
+    if (policy->path_table)
+    {
+        for (i = 0; i < (1U << policy->path_bits); i++)
+            hlist_for_each_entry_safe(entry, tmp, &policy->path_table[i], node)
+                kfree(entry);
+    }
+
+    kvfree(policy->user_table);
+    kvfree(policy->path_table);
+    kfree(policy);
+}
+
+//
+// The number of hash bits to use for the given number of entries.
+//
+static unsigned int can_exec_policy_bits(u32 count)
+{
+    if (count < 2)
+        return 1;
+
+    return min_t(unsigned int, order_base_2(count), CAN_EXEC_POLICY_MAX_BITS);
+}
+
+//
+// Build a policy from the compiled blob, validating it as we go.
+//
+static struct can_exec_policy *can_exec_policy_parse(const void *data, size_t size)
+{
+    const struct can_exec_policy_header *hdr = data;
+    const struct can_exec_policy_rule *rule;
+    struct can_exec_policy *policy;
+    const __u32 *uids;
+    size_t offset;
+    u32 i;
+
+    if (size < sizeof(*hdr) ||
+        hdr->magic != CAN_EXEC_POLICY_MAGIC ||
+        hdr->version != CAN_EXEC_POLICY_VERSION)
+        return ERR_PTR(-EINVAL);
+
+    if (hdr->uids > (size - sizeof(*hdr)) / sizeof(__u32))
+        return ERR_PTR(-EINVAL);
+
+    policy = kzalloc(sizeof(*policy), GFP_KERNEL);
+
+    if (!policy)
+        return ERR_PTR(-ENOMEM);
+
+    policy->user_bits = can_exec_policy_bits(hdr->uids);
+    policy->path_bits = can_exec_policy_bits(hdr->rules);
+    policy->user_table = kvcalloc(1U << policy->user_bits, sizeof(struct hlist_head), GFP_KERNEL);
+    policy->path_table = kvcalloc(1U << policy->path_bits, sizeof(struct hlist_head), GFP_KERNEL);
+
+    if (!policy->user_table || !policy->path_table)
+    {
+        can_exec_policy_free(policy);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    //
+    // The users covered by the policy.
+    //
+    uids = data + sizeof(*hdr);
+
+    for (i = 0; i < hdr->uids; i++)
+    {
+        struct can_exec_policy_user *user = kmalloc(sizeof(*user), GFP_KERNEL);
+
+        if (!user)
+        {
+            can_exec_policy_free(policy);
+            return ERR_PTR(-ENOMEM);
+        }
+
+        user->uid = uids[i];
+        hlist_add_head(&user->node, &policy->user_table[hash_32(user->uid, policy->user_bits)]);
+        policy->users++;
+    }
+
+    //
+    // The paths they may execute.
+    //
+    offset = sizeof(*hdr) + hdr->uids * sizeof(__u32);
+
+    for (i = 0; i < hdr->rules; i++)
+    {
+        struct can_exec_policy_path *entry;
+
+        if (size - offset < sizeof(*rule))
+            break;
+
+        rule = data + offset;
+        offset += sizeof(*rule);
+
+        if (rule->path_len == 0 || rule->path_len >= CAN_EXEC_PATH_MAX ||
+            size - offset < rule->path_len)
+            break;
+
+        entry = kmalloc(sizeof(*entry) + rule->path_len, GFP_KERNEL);
+
+        if (!entry)
+        {
+            can_exec_policy_free(policy);
+            return ERR_PTR(-ENOMEM);
+        }
+
+        entry->uid = rule->uid;
+        entry->len = rule->path_len;
+        memcpy(entry->path, data + offset, rule->path_len);
+        entry->hash = can_exec_policy_hash(entry->uid, entry->path, entry->len);
+        hlist_add_head(&entry->node, &policy->path_table[hash_32(entry->hash, policy->path_bits)]);
+        policy->paths++;
+
+        offset += ALIGN(rule->path_len, 4);
+
+        if (offset > size)
+            break;
+    }
+
+    if (i != hdr->rules || offset != size)
+    {
+        can_exec_policy_free(policy);
+        return ERR_PTR(-EINVAL);
+    }
+
+    return policy;
+}
+
+//
+// Replace the policy with one written by `can-exec-compile`.
+//
+// The policy must be written with a single write.
+//
+static ssize_t can_exec_policy_write(struct file *file, const char __user *buf,
+                                     size_t count, loff_t *ppos)
+{
+    struct can_exec_policy *policy, *old;
+    void *data;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (*ppos != 0)
+        return -EINVAL;
+
+    if (count > CAN_EXEC_POLICY_MAX)
+        return -EFBIG;
+
+    data = vmemdup_user(buf, count);
+
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+
+    policy = can_exec_policy_parse(data, count);
+    kvfree(data);
+
+    if (IS_ERR(policy))
+        return PTR_ERR(policy);
+
+    mutex_lock(&can_exec_policy_mutex);
+    old = rcu_dereference_protected(can_exec_policy,
+                                    lockdep_is_held(&can_exec_policy_mutex));
+    rcu_assign_pointer(can_exec_policy, policy);
+    mutex_unlock(&can_exec_policy_mutex);
+
+    //
+    // Cached verdicts may have come from the old policy.
+    //
+    can_exec_cache_flush_all();
+
+    synchronize_rcu();
+    can_exec_policy_free(old);
+
+    printk(KERN_INFO "can-exec policy loaded: %u users, %u rules\n",
+           policy->users, policy->paths);
+
+    *ppos += count;
+    return count;
+}
+
+static ssize_t can_exec_policy_read(struct file *file, char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+    struct can_exec_policy *policy;
+    unsigned int users = 0;
+    unsigned int paths = 0;
+    char tmp[64];
+    int len;
+
+    rcu_read_lock();
+    policy = rcu_dereference(can_exec_policy);
+
+    if (policy)
+    {
+        users = policy->users;
+        paths = policy->paths;
+    }
+
+    rcu_read_unlock();
+
+    len = scnprintf(tmp, sizeof(tmp), "users: %u\nrules: %u\n", users, paths);
+    return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static const struct file_operations can_exec_policy_fops =
+{
+    .read   = can_exec_policy_read,
+    .write  = can_exec_policy_write,
+    .llseek = generic_file_llseek,
+};
+
+
+//
+// The tasks we enforce upon.
+//
+// A task is in scope if its uid is listed - or no uids are - and it lies
+// beneath one of the listed cgroups - or none are.  With neither listed
+// every task is in scope.
+//
+// Uids below CAN_EXEC_SCOPE_LOW_UIDS are held in a bitmap, and the few
+// ranges above that in a short array, so that deciding is a constant-time
+// check.  The whole scope is replaced at once, so lookups need nothing
+// more than RCU.
+//
+#define CAN_EXEC_SCOPE_LOW_UIDS 65536
+#define CAN_EXEC_SCOPE_RANGES   16
+#define CAN_EXEC_SCOPE_CGROUPS  16
+#define CAN_EXEC_SCOPE_MAX      (64 * 1024)
+
+struct can_exec_scope_range
+{
+    uid_t first;
+    uid_t last;
+};
+
+struct can_exec_scope
+{
+    bool uids;
+    unsigned int ranges;
+    unsigned int cgroups;
+    struct can_exec_scope_range range[CAN_EXEC_SCOPE_RANGES];
+    struct cgroup *cgroup[CAN_EXEC_SCOPE_CGROUPS];
+    char *text;
+    DECLARE_BITMAP(low, CAN_EXEC_SCOPE_LOW_UIDS);
+};
+
+static struct can_exec_scope __rcu *can_exec_scope;
+static DEFINE_MUTEX(can_exec_scope_mutex);
+
+
+static bool can_exec_scope_uid(const struct can_exec_scope *scope, uid_t uid)
+{
+    unsigned int i;
+
+    if (!scope->uids)
+        return true;
+
+    if (uid < CAN_EXEC_SCOPE_LOW_UIDS)
+        return test_bit(uid, scope->low);
+
+    for (i = 0; i < scope->ranges; i++)
+        if (uid >= scope->range[i].first && uid <= scope->range[i].last)
+            return true;
+
+    return false;
+}
+
+static bool can_exec_scope_cgroup(const struct can_exec_scope *scope)
+{
+#ifdef CONFIG_CGROUPS
+    struct cgroup *cgrp;
+    unsigned int i;
+
+    if (!scope->cgroups)
+        return true;
+
+    cgrp = task_dfl_cgroup(current);
+
+    for (i = 0; i < scope->cgroups; i++)
+        if (cgroup_is_descendant(cgrp, scope->cgroup[i]))
+            return true;
+
+    return false;
+#else
+    return true;
+#endif
+}
+
+//
+// Should the current task, running as the given user, be checked?
+//
+static bool can_exec_in_scope(kuid_t uid)
+{
+    struct can_exec_scope *scope;
+    bool ret = true;
+
+    if (!rcu_access_pointer(can_exec_scope))
+        return true;
+
+    rcu_read_lock();
+
+    scope = rcu_dereference(can_exec_scope);
+
+    if (scope)
+        ret = can_exec_scope_uid(scope, uid.val) && can_exec_scope_cgroup(scope);
+
+    rcu_read_unlock();
+    return ret;
+}
+
+static void can_exec_scope_free(struct can_exec_scope *scope)
+{
+    unsigned int i __maybe_unused;
+
+    if (!scope)
+        return;
+
+#ifdef CONFIG_CGROUPS
+    for (i = 0; i < scope->cgroups; i++)
+        cgroup_put(scope->cgroup[i]);
+#endif
+
+    kfree(scope->text);
+    kvfree(scope);
+}
+
+//
+// Add a line of the form `uid N`, `uid N-M` or `cgroup /path`.
+//
+static int can_exec_scope_parse_line(struct can_exec_scope *scope, char *line)
+{
+    u32 first, last;
+    char dash;
+    int n;
+
+    if (strncmp(line, "uid", 3) == 0 && isspace(line[3]))
+    {
+        n = sscanf(line + 3, " %u %c %u", &first, &dash, &last);
+
+        if (n == 1)
+            last = first;
+        else if (n != 3 || dash != '-' || last < first)
+            return -EINVAL;
+
+        scope->uids = true;
+
+        if (first < CAN_EXEC_SCOPE_LOW_UIDS)
+        {
+            u32 end = min_t(u32, last, CAN_EXEC_SCOPE_LOW_UIDS - 1);
+
+            bitmap_set(scope->low, first, end - first + 1);
+
+            if (last == end)
+                return 0;
+
+            first = CAN_EXEC_SCOPE_LOW_UIDS;
+        }
+
+        if (scope->ranges == CAN_EXEC_SCOPE_RANGES)
+            return -E2BIG;
+
+        scope->range[scope->ranges].first = first;
+        scope->range[scope->ranges].last = last;
+        scope->ranges++;
+        return 0;
+    }
+
+    if (strncmp(line, "cgroup", 6) == 0 && isspace(line[6]))
+    {
+#ifdef CONFIG_CGROUPS
+        struct cgroup *cgrp;
+
+        if (scope->cgroups == CAN_EXEC_SCOPE_CGROUPS)
+            return -E2BIG;
+
+        cgrp = cgroup_get_from_path(strim(line + 6));
+
+        if (IS_ERR(cgrp))
+            return PTR_ERR(cgrp);
+
+        scope->cgroup[scope->cgroups++] = cgrp;
+        return 0;
+#else
+        return -EOPNOTSUPP;
+#endif
+    }
+
+    return -EINVAL;
+}
+
+//
+// Replace the scope.  Blank lines, and those beginning with `#`, are
+// ignored, so writing nothing at all removes it.
+//
+// The scope must be written with a single write.
+//
+static ssize_t can_exec_scope_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+    struct can_exec_scope *scope, *old;
+    char *data, *cur, *line;
+    int rc = 0;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (*ppos != 0)
+        return -EINVAL;
+
+    if (count > CAN_EXEC_SCOPE_MAX)
+        return -EFBIG;
+
+    data = memdup_user_nul(buf, count);
+
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+
+    scope = kvzalloc(sizeof(*scope), GFP_KERNEL);
+
+    if (!scope)
+    {
+        kfree(data);
+        return -ENOMEM;
+    }
+
+    scope->text = kstrdup(data, GFP_KERNEL);
+    cur = data;
+
+    while (scope->text && (line = strsep(&cur, "\n")) != NULL)
+    {
+        line = strim(line);
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        rc = can_exec_scope_parse_line(scope, line);
+
+        if (rc)
+            break;
+    }
+
+    kfree(data);
+
+    if (!scope->text)
+        rc = -ENOMEM;
+
+    if (rc)
+    {
+        can_exec_scope_free(scope);
+        return rc;
+    }
+
+    //
+    // An empty scope is no scope at all.
+    //
+    if (!scope->uids && !scope->cgroups)
+    {
+        can_exec_scope_free(scope);
+        scope = NULL;
+    }
+
+    mutex_lock(&can_exec_scope_mutex);
+    old = rcu_dereference_protected(can_exec_scope,
+                                    lockdep_is_held(&can_exec_scope_mutex));
+    rcu_assign_pointer(can_exec_scope, scope);
+    mutex_unlock(&can_exec_scope_mutex);
+
+    synchronize_rcu();
+    can_exec_scope_free(old);
+
+    *ppos += count;
+    return count;
+}
+
+static ssize_t can_exec_scope_read(struct file *file, char __user *buf,
+                                   size_t count, loff_t *ppos)
+{
+    struct can_exec_scope *scope;
+    ssize_t rc;
+
+    mutex_lock(&can_exec_scope_mutex);
+    scope = rcu_dereference_protected(can_exec_scope,
+                                      lockdep_is_held(&can_exec_scope_mutex));
+
+    if (scope)
+        rc = simple_read_from_buffer(buf, count, ppos, scope->text, strlen(scope->text));
+    else
+        rc = 0;
+
+    mutex_unlock(&can_exec_scope_mutex);
+    return rc;
+}
+
+static const struct file_operations can_exec_scope_fops =
+{
+    .read   = can_exec_scope_read,
+    .write  = can_exec_scope_write,
+    .llseek = generic_file_llseek,
+};
+
+
+//
+// Round-trip latencies, for the daemon and the helper.
+//
+// Each is a log2 histogram of microseconds, kept per CPU so that
+// recording a sample never contends; they're summed when read from
+// /sys/kernel/security/can-exec/latency.
+//
+#define CAN_EXEC_LATENCY_BUCKETS 32
+
+enum can_exec_source
+{
+    CAN_EXEC_DAEMON,
+    CAN_EXEC_HELPER,
+    CAN_EXEC_SOURCES,
+};
+
+static const char * const can_exec_source_names[CAN_EXEC_SOURCES] =
+{
+    [CAN_EXEC_DAEMON] = "daemon",
+    [CAN_EXEC_HELPER] = "helper",
+};
+
+struct can_exec_latency
+{
+    u64 hist[CAN_EXEC_SOURCES][CAN_EXEC_LATENCY_BUCKETS];
+    u64 timeouts[CAN_EXEC_SOURCES];
+};
+
+static DEFINE_PER_CPU(struct can_exec_latency, can_exec_latency);
+
+
+static void can_exec_latency_record(enum can_exec_source source, ktime_t start,
+                                    bool timed_out)
+{
+    u64 us = ktime_us_delta(ktime_get(), start);
+    unsigned int bucket = us ? min_t(unsigned int, ilog2(us) + 1,
+                                     CAN_EXEC_LATENCY_BUCKETS - 1) : 0;
+
+    this_cpu_inc(can_exec_latency.hist[source][bucket]);
+
+    if (timed_out)
+        this_cpu_inc(can_exec_latency.timeouts[source]);
+}
+
+//
+// Bucket `n` holds round-trips of [2^(n-1), 2^n) microseconds, and bucket
+// zero those which took less than one.
+//
+static int can_exec_latency_show(struct seq_file *m, void *v)
+{
+    enum can_exec_source source;
+    unsigned int bucket;
+    int cpu;
+
+    for (source = 0; source < CAN_EXEC_SOURCES; source++)
+    {
+        u64 timeouts = 0;
+
+        for_each_possible_cpu(cpu)
+            timeouts += per_cpu(can_exec_latency.timeouts[source], cpu);
+
+        seq_printf(m, "%s timeouts: %llu\n", can_exec_source_names[source], timeouts);
+
+        for (bucket = 0; bucket < CAN_EXEC_LATENCY_BUCKETS; bucket++)
+        {
+            u64 count = 0;
+
+            for_each_possible_cpu(cpu)
+                count += per_cpu(can_exec_latency.hist[source][bucket], cpu);
+
+            if (count == 0)
+                continue;
+
+            seq_printf(m, "%s %llu-%lluus: %llu\n", can_exec_source_names[source],
+                       bucket ? 1ULL << (bucket - 1) : 0, 1ULL << bucket, count);
+        }
+    }
+
+    return 0;
+}
+
+static int can_exec_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, can_exec_latency_show, NULL);
+}
+
+static const struct file_operations can_exec_latency_fops =
+{
+    .open    = can_exec_latency_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+//
+// The verdict to use when the daemon or helper takes too long.
+//
+static int can_exec_timeout_result(void)
+{
+    return READ_ONCE(can_exec_timeout_verdict) ? -EPERM : 0;
+}
+
+
+//
+// A request waiting for the daemon.
+//
+// These live upon the stack of the task which is executing, and are
+// moved from the queue to the in-flight table, keyed by ID, as the daemon
+// reads them, so that each of its replies finds its request directly.
+// The request itself was allocated by that task, which frees it once it
+// has been withdrawn or answered.
+//
+struct can_exec_pending
+{
+    struct list_head list;      // upon can_exec_queue, while queued
+    struct hlist_node node;     // in can_exec_inflight, once read
+    struct can_exec_request *req;
+    int verdict;
+    struct completion done;
+};
+
+static DEFINE_SPINLOCK(can_exec_lock);
+static LIST_HEAD(can_exec_queue);
+static DEFINE_HASHTABLE(can_exec_inflight, 10);
+static DECLARE_WAIT_QUEUE_HEAD(can_exec_daemon_wait);
+static struct pid *can_exec_daemon;
+static u64 can_exec_next_id;
+
+
+//
+// Is the current task the daemon?  Its own executions are always permitted.
+//
+static bool can_exec_is_daemon(void)
+{
+    return READ_ONCE(can_exec_daemon) == task_tgid(current);
+}
+
+//
+// Ask the daemon for a verdict, waiting for at most `timeout` jiffies.
+//
+// Returns 0 to allow, -EPERM to deny, -ENOTCONN if there is no daemon,
+// -ETIMEDOUT if it didn't answer in time, or -EINTR if we were killed
+// whilst waiting.
+//
+static int can_exec_ask_daemon(struct can_exec_request *request, long timeout)
+{
+    struct can_exec_pending req;
+    ktime_t start = ktime_get();
+    long rc;
+
+    if (!READ_ONCE(can_exec_daemon))
+        return -ENOTCONN;
+
+    INIT_LIST_HEAD(&req.list);
+    INIT_HLIST_NODE(&req.node);
+    req.req = request;
+    req.verdict = -ENOTCONN;
+    init_completion(&req.done);
+
+    spin_lock(&can_exec_lock);
+
+    if (!can_exec_daemon)
+    {
+        spin_unlock(&can_exec_lock);
+        return -ENOTCONN;
+    }
+
+    request->id = ++can_exec_next_id;
+    list_add_tail(&req.list, &can_exec_queue);
+    spin_unlock(&can_exec_lock);
+
+    wake_up_interruptible(&can_exec_daemon_wait);
+
+    rc = wait_for_completion_killable_timeout(&req.done, timeout);
+
+    if (rc <= 0)
+    {
+        //
+        // We've been killed, or given up.  Withdraw the request, unless it
+        // is being answered right now, in which case we wait for that.
+        //
+        spin_lock(&can_exec_lock);
+
+        if (!list_empty(&req.list) || hash_hashed(&req.node))
+        {
+            list_del_init(&req.list);
+            hash_del(&req.node);
+            spin_unlock(&can_exec_lock);
+
+            if (rc < 0)
+                return -EINTR;
+
+            can_exec_latency_record(CAN_EXEC_DAEMON, start, true);
+            return -ETIMEDOUT;
+        }
+
+        spin_unlock(&can_exec_lock);
+        wait_for_completion(&req.done);
+    }
+
+    if (req.verdict == -ENOTCONN)
+        return -ENOTCONN;
+
+    can_exec_latency_record(CAN_EXEC_DAEMON, start, false);
+    return req.verdict == 0 ? 0 : -EPERM;
+}
+
+//
+// Complete every queued and in-flight request with the given verdict.
+//
+// Called with can_exec_lock held.
+//
+static void can_exec_fail_all(int verdict)
+{
+    struct can_exec_pending *req, *tmp;
+    struct hlist_node *next;
+    int bkt;
+
+    list_for_each_entry_safe(req, tmp, &can_exec_queue, list)
+    {
+        list_del_init(&req->list);
+        req->verdict = verdict;
+        complete(&req->done);
+    }
+
+    hash_for_each_safe(can_exec_inflight, bkt, next, req, node)
+    {
+        hash_del(&req->node);
+        req->verdict = verdict;
+        complete(&req->done);
+    }
+}
+
+//
+// Find the in-flight request with the given ID.
+//
+// Called with can_exec_lock held.
+//
+static struct can_exec_pending *can_exec_inflight_find(u64 id)
+{
+    struct can_exec_pending *req;
+
+    hash_for_each_possible(can_exec_inflight, req, node, id)
+    {
+        if (req->req->id == id)
+            return req;
+    }
+
+    return NULL;
+}
+
+//
+// Only a single daemon may be connected at once.
+//
+static int can_exec_channel_open(struct inode *inode, struct file *file)
+{
+    int rc = 0;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    spin_lock(&can_exec_lock);
+
+    if (can_exec_daemon)
+        rc = -EBUSY;
+    else
+        WRITE_ONCE(can_exec_daemon, get_pid(task_tgid(current)));
+
+    spin_unlock(&can_exec_lock);
+
+    if (rc == 0)
+        printk(KERN_INFO "can-exec daemon connected, pid %d\n", task_tgid_nr(current));
+
+    return rc;
+}
+
+//
+// When the daemon goes away every outstanding request falls back to
+// the user-space helper.
+//
+static int can_exec_channel_release(struct inode *inode, struct file *file)
+{
+    struct pid *pid;
+
+    spin_lock(&can_exec_lock);
+    pid = can_exec_daemon;
+    WRITE_ONCE(can_exec_daemon, NULL);
+    can_exec_fail_all(-ENOTCONN);
+    spin_unlock(&can_exec_lock);
 
+    put_pid(pid);
+    printk(KERN_INFO "can-exec daemon disconnected\n");
+    return 0;
+}
 
 //
-// Is this module enabled?
+// Hand as many queued requests to the daemon as will fit in its buffer.
 //
-// Controlled via /proc/sys/kernel/can-exec/enabled
+// Unless the channel is non-blocking we wait for at least one.
 //
-static int can_exec_enabled = 0;
+// A request may be withdrawn as soon as we drop the lock, so each is
+// copied into a bounce buffer first - only as far as its path goes.
+//
+static ssize_t can_exec_channel_read(struct file *file, char __user *buf,
+                                     size_t count, loff_t *ppos)
+{
+    struct can_exec_request *out;
+    struct can_exec_pending *req;
+    size_t done, len;
+    u64 id;
+    int rc;
+
+    if (count < sizeof(*out))
+        return -EINVAL;
+
+retry:
+    if (!(file->f_flags & O_NONBLOCK))
+    {
+        rc = wait_event_interruptible(can_exec_daemon_wait,
+                                      !list_empty_careful(&can_exec_queue));
+
+        if (rc)
+            return rc;
+    }
+
+    out = kzalloc(sizeof(*out), GFP_KERNEL);
+
+    if (!out)
+        return -ENOMEM;
+
+    done = 0;
+
+    while (done + sizeof(*out) <= count)
+    {
+        spin_lock(&can_exec_lock);
+
+        if (list_empty(&can_exec_queue))
+        {
+            spin_unlock(&can_exec_lock);
+            break;
+        }
+
+        req = list_first_entry(&can_exec_queue, struct can_exec_pending, list);
+        list_del_init(&req->list);
+        hash_add(can_exec_inflight, &req->node, req->req->id);
+
+        len = offsetof(struct can_exec_request, path) + req->req->path_len + 1;
+        memcpy(out, req->req, len);
+        id = out->id;
+
+        spin_unlock(&can_exec_lock);
+
+        if (copy_to_user(buf + done, out, sizeof(*out)))
+        {
+            //
+            // Put the request back, if it is still waiting, so it isn't lost.
+            //
+            spin_lock(&can_exec_lock);
+            req = can_exec_inflight_find(id);
+
+            if (req)
+            {
+                hash_del(&req->node);
+                list_add(&req->list, &can_exec_queue);
+            }
+
+            spin_unlock(&can_exec_lock);
+
+            if (done == 0)
+            {
+                kfree(out);
+                return -EFAULT;
+            }
+
+            break;
+        }
+
+        done += sizeof(*out);
+    }
+
+    kfree(out);
+
+    //
+    // Another reader may have beaten us to the queue.
+    //
+    if (done == 0)
+    {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        goto retry;
+    }
+
+    return done;
+}
+
+//
+// Accept a batch of verdicts from the daemon.
+//
+static ssize_t can_exec_channel_write(struct file *file, const char __user *buf,
+                                      size_t count, loff_t *ppos)
+{
+    struct can_exec_reply reply;
+    struct can_exec_pending *req;
+    size_t done = 0;
+
+    if (count < sizeof(reply) || count % sizeof(reply))
+        return -EINVAL;
+
+    while (done < count)
+    {
+        if (copy_from_user(&reply, buf + done, sizeof(reply)))
+            return done ? done : -EFAULT;
+
+        spin_lock(&can_exec_lock);
+        req = can_exec_inflight_find(reply.id);
+
+        if (req)
+        {
+            hash_del(&req->node);
+            req->verdict = reply.verdict;
+            complete(&req->done);
+        }
+
+        spin_unlock(&can_exec_lock);
+
+        done += sizeof(reply);
+    }
+
+    return done;
+}
+
+static __poll_t can_exec_channel_poll(struct file *file, poll_table *wait)
+{
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &can_exec_daemon_wait, wait);
+
+    if (!list_empty_careful(&can_exec_queue))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    return mask;
+}
+
+static const struct file_operations can_exec_channel_fops =
+{
+    .open    = can_exec_channel_open,
+    .release = can_exec_channel_release,
+    .read    = can_exec_channel_read,
+    .write   = can_exec_channel_write,
+    .poll    = can_exec_channel_poll,
+    .llseek  = noop_llseek,
+};
 
 
 //
-// Attempt to get the fully-qualified path of the given file.
+// A run of the helper which may have to be cut short.
 //
-// I suspect this is fragile and won't cope with mount-points, etc.
+// The helper records its pid here before it executes, and if the deadline
+// passes first the timer kills it.  Either may happen first, so both
+// take the lock.
 //
-char *get_path(struct file *file, char *buf, int buflen)
+struct can_exec_helper_call
 {
-    struct dentry *dentry = file->f_path.dentry;
-    char *ret = dentry_path_raw(dentry, buf, buflen);
-    return ret;
+    spinlock_t lock;
+    struct pid *pid;
+    bool timed_out;
+    struct timer_list timer;
+};
+
+//
+// Called in the helper, before it executes.
+//
+static int can_exec_helper_init(struct subprocess_info *info, struct cred *new)
+{
+    struct can_exec_helper_call *call = info->data;
+    int rc = 0;
+
+    spin_lock_bh(&call->lock);
+
+    if (call->timed_out)
+        rc = -ETIMEDOUT;
+    else
+        call->pid = get_pid(task_pid(current));
+
+    spin_unlock_bh(&call->lock);
+    return rc;
 }
 
+static void can_exec_helper_expired(struct timer_list *t)
+{
+    struct can_exec_helper_call *call = from_timer(call, t, timer);
+
+    spin_lock(&call->lock);
+
+    call->timed_out = true;
+
+    if (call->pid)
+        kill_pid(call->pid, SIGKILL, 1);
+
+    spin_unlock(&call->lock);
+}
 
 //
-//  If this module is enabled then call our user-space helper,
-// `/sbin/can-exec` to decide if child-processes can be executed.
+// Run the user-space helper, `/sbin/can-exec`, for the given request,
+// killing it if it runs for more than `timeout` jiffies.
 //
-static int can_exec_bprm_check_security_usermode(struct linux_binprm *bprm)
+// Returns 0 to allow, -EPERM to deny, or -ETIMEDOUT if the helper didn't
+// finish in time and was killed.
+//
+static int can_exec_ask_helper(struct can_exec_request *req, long timeout)
 {
     struct subprocess_info *sub_info;
-    int ret = 0;
-    char *argv[4];
-
-    //
-    // The current task & UID.
-    //
-    const struct task_struct *task = current;
-    kuid_t uid = task->cred->uid;
+    struct can_exec_helper_call call;
+    ktime_t start;
+    int ret;
+    char uid[16];
+    char ident[48];
+    char *argv[5];
 
     //
     // Environment for our user-space helper.
@@ -89,6 +1635,84 @@ static int can_exec_bprm_check_security_usermode(struct linux_binprm *bprm)
         "PATH=/sbin:/bin:/usr/sbin:/usr/bin", NULL
     };
 
+    snprintf(uid, sizeof(uid), "%u", req->uid);
+
+    argv[0] = "/sbin/can-exec";                    // helper
+    argv[1] = uid;                                 // UID
+    argv[2] = req->path;                           // CMD
+    argv[3] = NULL;                                // Terminator
+
+    if (req->flags & CAN_EXEC_REQUEST_LOCAL_PATH)
+    {
+        snprintf(ident, sizeof(ident), "%llu:%llu", req->dev, req->ino);
+        argv[3] = ident;                           // DEV:INO
+        argv[4] = NULL;                            // Terminator
+    }
+
+    spin_lock_init(&call.lock);
+    call.pid = NULL;
+    call.timed_out = false;
+
+    //
+    // Prepare to execute the user-space helper.
+    //
+    sub_info = call_usermodehelper_setup(argv[0], argv, envp, GFP_KERNEL,
+                                         can_exec_helper_init, NULL, &call);
+
+    if (sub_info == NULL)
+    {
+        printk(KERN_INFO "failed to call call_usermodehelper_setup\n");
+        return -ENOMEM;
+    }
+
+    timer_setup_on_stack(&call.timer, can_exec_helper_expired, 0);
+
+    if (timeout != MAX_SCHEDULE_TIMEOUT)
+        mod_timer(&call.timer, jiffies + timeout);
+
+    //
+    // Call the helper and get the return-code.
+    //
+    start = ktime_get();
+    ret = call_usermodehelper_exec(sub_info, UMH_WAIT_PROC);
+
+    del_timer_sync(&call.timer);
+    destroy_timer_on_stack(&call.timer);
+    put_pid(call.pid);
+
+    can_exec_latency_record(CAN_EXEC_HELPER, start, call.timed_out);
+
+    if (call.timed_out)
+    {
+        pr_info_ratelimited("can-exec helper timed out for %s\n", argv[2]);
+        return -ETIMEDOUT;
+    }
+
+    ret = (ret >> 8) & 0xff;
+
+    return ret == 0 ? 0 : -EPERM;
+}
+
+//
+// Decide whether the execution described by `bprm` may proceed.
+//
+static int can_exec_check(struct linux_binprm *bprm)
+{
+    struct can_exec_request *scratch;
+    struct can_exec_request *req = NULL;
+    struct can_exec_cache_key key;
+    unsigned long start = jiffies;
+    unsigned int gen;
+    long timeout;
+    int ret = 0;
+    int err;
+
+    //
+    // The current task & UID.
+    //
+    const struct cred *cred = current_cred();
+    kuid_t uid = cred->uid;
+
     //
     // If this module is not enabled we allow all.
     //
@@ -96,102 +1720,122 @@ static int can_exec_bprm_check_security_usermode(struct linux_binprm *bprm)
         return 0;
 
     //
-    // If we're trying to exec our helper - then allow it
+    // If this task isn't one we're enforcing upon we allow it.
     //
-    if (strcmp(bprm->filename, "/sbin/can-exec") == 0)
+    if (!can_exec_in_scope(uid))
         return 0;
 
     //
-    // The command we'll be executing.
+    // If we're trying to exec our helper - then allow it
     //
-    argv[0] = "/sbin/can-exec";                    // helper
-    argv[1] = (char *)kmalloc(10, GFP_KERNEL);     // UID
-    argv[2] = NULL;                                // CMD
-    argv[3] = NULL;                                // Terminator
+    if (strcmp(bprm->filename, "/sbin/can-exec") == 0)
+        return 0;
 
     //
-    // Populate the UID.
+    // The daemon can execute whatever it likes, as it would otherwise
+    // be waiting upon itself.
     //
-    sprintf(argv[1], "%d",  uid.val);
+    if (can_exec_is_daemon())
+        return 0;
 
     //
-    // Get the fully-qualified path to the command the user is trying to run.
+    // Have we already decided?
     //
-    {
-        char *path_buff = kmalloc(PAGE_SIZE, GFP_KERNEL);
-        char *path = NULL;
-
-        if (unlikely(!path_buff))
-        {
-            printk(KERN_INFO "kmalloc failed for path_buff");
+    can_exec_cache_key_init(&key, uid, file_inode(bprm->file));
 
-            // avoid leaking
-            kfree(argv[1]);
+    if (can_exec_cache_lookup(&key, &ret))
+        return ret;
 
-            return -ENOMEM;
-        }
+    gen = can_exec_cache_generation();
 
-        memset(path_buff, 0, PAGE_SIZE);
+    //
+    // Describe the execution, in this CPU's scratch area, and if the
+    // compiled policy covers this user then we're done - unless the path
+    // can't be trusted to name the file.
+    //
+    scratch = get_cpu_var(can_exec_scratch);
 
-        path = get_path(bprm->file, path_buff, PAGE_SIZE);
+    err = can_exec_request_init(scratch, cred, bprm->file);
 
-        if (path != NULL)
-        {
-            argv[2] = kstrdup(path, GFP_KERNEL);
-            kfree(path_buff);
-        }
-        else
-        {
-            printk(KERN_INFO "calling get_path failed!");
+    if (err == 0 && !(scratch->flags & CAN_EXEC_REQUEST_LOCAL_PATH))
+        ret = can_exec_policy_check(uid, scratch->path, scratch->path_len);
+    else if (err == 0)
+        ret = -ENOENT;
 
-            // avoid leaking
-            kfree(argv[1]);
-            kfree(path_buff);
-            return -EPERM;
-        }
-    }
+    put_cpu_var(can_exec_scratch);
 
     //
-    // Prepare to execute the user-space helper.
+    // Otherwise we need a request of our own to wait upon.
     //
-    sub_info = call_usermodehelper_setup(argv[0], argv, envp, GFP_KERNEL,
-                                         NULL, NULL, NULL);
+    if (err == 0 && ret == -ENOENT)
+    {
+        req = kmem_cache_alloc(can_exec_request_cache, GFP_KERNEL);
+        err = req ? can_exec_request_init(req, cred, bprm->file) : -ENOMEM;
+    }
 
-    if (sub_info == NULL)
+    if (err)
     {
-        printk(KERN_INFO "failed to call call_usermodehelper_setup\n");
+        printk(KERN_INFO "failed to describe the execution of %s\n", bprm->filename);
+        lsm_stats_inc(&can_exec_stats, LSM_STAT_ERRORS);
 
-        // Avoid leaking
-        kfree(argv[1]);
-        kfree(argv[2]);
-        return -ENOMEM;
+        if (req)
+            kmem_cache_free(can_exec_request_cache, req);
+
+        return -EPERM;
     }
 
+    if (!req)
+        return ret;
 
     //
-    // Call the helper and get the return-code.
+    // If there's a daemon running then ask it, otherwise run the helper,
+    // with whatever time we have left.
     //
-    ret = call_usermodehelper_exec(sub_info, UMH_WAIT_PROC);
-    ret = (ret >> 8) & 0xff;
+    timeout = can_exec_time_left(start);
+    ret = timeout ? can_exec_ask_daemon(req, timeout) : -ETIMEDOUT;
 
-    //
-    // Prevent leaks
-    //
-    kfree(argv[1]);
-    kfree(argv[2]);
+    if (ret == -ENOTCONN)
+    {
+        timeout = can_exec_time_left(start);
+        ret = timeout ? can_exec_ask_helper(req, timeout) : -ETIMEDOUT;
+    }
 
     //
-    // Show the result.
+    // Verdicts given because the answer came too late aren't cached, so
+    // we'll ask again next time.
     //
-    printk(KERN_INFO "Return code from user-space was %d\n", ret);
-
-    if (ret == 0)
-        return (ret);
+    if (ret == -ETIMEDOUT)
+        ret = can_exec_timeout_result();
+    else if (ret == 0 || ret == -EPERM)
+        can_exec_cache_store(&key, gen, ret);
     else
-        return (-EPERM);
+        lsm_stats_inc(&can_exec_stats, LSM_STAT_ERRORS);
+
+    kmem_cache_free(can_exec_request_cache, req);
+    return ret;
+}
 
+//
+//  If this module is enabled then call our user-space helper,
+// `/sbin/can-exec` to decide if child-processes can be executed.
+//
+// We're the last stage of the pipeline, so only see executions which the
+// other stages allowed, and unlike them we check root too.
+//
+static int can_exec_stage_check(struct exec_policy_ctx *ctx)
+{
+    return can_exec_check(ctx->bprm);
 }
 
+static struct exec_policy_stage can_exec_stage __ro_after_init =
+{
+    .name   = "can-exec",
+    .id     = EXEC_POLICY_STAGE_CAN_EXEC,
+    .flags  = EXEC_POLICY_ROOT,
+    .stats  = &can_exec_stats,
+    .check  = can_exec_stage_check,
+};
+
 
 struct ctl_path can_exec_sysctl_path[] =
 {
@@ -212,34 +1856,151 @@ static struct ctl_table can_exec_sysctl_table[] =
         .extra1         = SYSCTL_ONE,
         .extra2         = SYSCTL_ONE,
     },
+    {
+        .procname       = "cache_ttl",
+        .data           = &can_exec_cache_ttl,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec_minmax,
+        .extra1         = SYSCTL_ZERO,
+        .extra2         = &can_exec_cache_ttl_max,
+    },
+    {
+        .procname       = "cache_flush",
+        .data           = &can_exec_cache_flush,
+        .maxlen         = sizeof(int),
+        .mode           = 0200,
+        .proc_handler   = can_exec_cache_flush_handler,
+    },
+    {
+        .procname       = "timeout",
+        .data           = &can_exec_timeout,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec_minmax,
+        .extra1         = SYSCTL_ZERO,
+        .extra2         = &can_exec_timeout_max,
+    },
+    {
+        .procname       = "timeout_verdict",
+        .data           = &can_exec_timeout_verdict,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec_minmax,
+        .extra1         = SYSCTL_ZERO,
+        .extra2         = SYSCTL_ONE,
+    },
     { }
 };
 
 
-/*
- * The hooks we wish to be installed.
- */
-static struct security_hook_list can_exec_hooks[] __lsm_ro_after_init =
-{
-    LSM_HOOK_INIT(bprm_check_security, can_exec_bprm_check_security_usermode),
-};
-
 /*
  * Initialize our module.
  */
 static int __init can_exec_init(void)
 {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        per_cpu(can_exec_scratch, cpu) = kmalloc(sizeof(struct can_exec_request), GFP_KERNEL);
+
+        if (!per_cpu(can_exec_scratch, cpu))
+            panic("can-exec scratch allocation failed.\n");
+    }
+
+    can_exec_request_cache = KMEM_CACHE(can_exec_request, 0);
+
+    if (!can_exec_request_cache)
+        panic("can-exec request cache allocation failed.\n");
+
     /* register /proc/sys/can-exec/enabled */
     if (!register_sysctl_paths(can_exec_sysctl_path, can_exec_sysctl_table))
         panic("sysctl registration failed.\n");
 
-    /* register ourselves with the security framework */
-    security_add_hooks(can_exec_hooks, ARRAY_SIZE(can_exec_hooks), "can_exec");
+    /* register ourselves with the execution pipeline */
+    exec_policy_add_stage(&can_exec_stage);
     printk(KERN_INFO "LSM initialized: can_exec\n");
     return 0;
 }
 
 
+/*
+ * Create our securityfs entries, once securityfs is available.
+ */
+static int __init can_exec_init_securityfs(void)
+{
+    struct dentry *dir;
+    struct dentry *channel;
+    struct dentry *policy;
+    struct dentry *latency;
+    struct dentry *scope;
+    struct dentry *stats;
+
+    dir = securityfs_create_dir("can-exec", NULL);
+
+    if (IS_ERR(dir))
+        return PTR_ERR(dir);
+
+    channel = securityfs_create_file("channel", 0600, dir, NULL,
+                                     &can_exec_channel_fops);
+
+    if (IS_ERR(channel))
+    {
+        securityfs_remove(dir);
+        return PTR_ERR(channel);
+    }
+
+    policy = securityfs_create_file("policy", 0600, dir, NULL,
+                                    &can_exec_policy_fops);
+
+    if (IS_ERR(policy))
+    {
+        securityfs_remove(channel);
+        securityfs_remove(dir);
+        return PTR_ERR(policy);
+    }
+
+    latency = securityfs_create_file("latency", 0444, dir, NULL,
+                                     &can_exec_latency_fops);
+
+    if (IS_ERR(latency))
+    {
+        securityfs_remove(policy);
+        securityfs_remove(channel);
+        securityfs_remove(dir);
+        return PTR_ERR(latency);
+    }
+
+    scope = securityfs_create_file("scope", 0600, dir, NULL,
+                                   &can_exec_scope_fops);
+
+    if (IS_ERR(scope))
+    {
+        securityfs_remove(latency);
+        securityfs_remove(policy);
+        securityfs_remove(channel);
+        securityfs_remove(dir);
+        return PTR_ERR(scope);
+    }
+
+    stats = lsm_stats_create(&can_exec_stats, dir);
+
+    if (IS_ERR(stats))
+    {
+        securityfs_remove(scope);
+        securityfs_remove(latency);
+        securityfs_remove(policy);
+        securityfs_remove(channel);
+        securityfs_remove(dir);
+        return PTR_ERR(stats);
+    }
+
+    return 0;
+}
+fs_initcall(can_exec_init_securityfs);
+
+
 /*
  * Ensure the initialization code is called.
  */
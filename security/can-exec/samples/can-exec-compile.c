@@ -0,0 +1,435 @@
+/*
+ * Compile the policy in /etc/can-exec/ for the `can_exec` LSM.
+ *
+ * Each file /etc/can-exec/$USERNAME.conf lists the commands that user
+ * may execute.  These are compiled into the binary format described in
+ * `can_exec.h`, which the kernel can check without asking user-space:
+ *
+ *   can-exec-compile [-d dir] [-o file] [-l] [-i]
+ *
+ * -d  Read the configuration from the given directory, default /etc/can-exec.
+ * -o  Write the compiled policy to the given file.
+ * -l  Load the compiled policy into the kernel.
+ * -i  Write an index, $USERNAME.idx, beside each configuration file, which
+ *     the helper will use in preference to parsing the text.  The format
+ *     is described in `index.h`.
+ *
+ * Root is never included, so remains decided by the daemon or helper.
+ * Nor are users with patterns, described in `matcher.h`, in their rules,
+ * since the kernel only matches exact paths.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "../can_exec.h"
+#include "index.h"
+#include "matcher.h"
+#include "policy.h"
+
+#define POLICY "/sys/kernel/security/can-exec/policy"
+
+
+//
+// The policy being built.
+//
+static __u32 *uids;
+static size_t uid_count;
+
+static char *rules;
+static size_t rules_len;
+static size_t rules_size;
+static size_t rule_count;
+
+//
+// The rules from the current configuration file.
+//
+static int make_index;
+static char **commands;
+static size_t command_count;
+
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    void *ret = realloc(ptr, size);
+
+    if (!ret)
+    {
+        perror("realloc");
+        exit(1);
+    }
+
+    return ret;
+}
+
+static void add_uid(uid_t uid)
+{
+    uids = xrealloc(uids, (uid_count + 1) * sizeof(*uids));
+    uids[uid_count++] = uid;
+}
+
+static void add_rule(uid_t uid, const char *path)
+{
+    struct can_exec_policy_rule rule;
+    size_t len = strlen(path);
+    size_t padded = (len + 3) & ~(size_t)3;
+
+    if (len == 0 || len >= CAN_EXEC_PATH_MAX)
+        return;
+
+    while (rules_len + sizeof(rule) + padded > rules_size)
+    {
+        rules_size = rules_size ? rules_size * 2 : 4096;
+        rules = xrealloc(rules, rules_size);
+    }
+
+    rule.uid = uid;
+    rule.path_len = len;
+
+    memcpy(rules + rules_len, &rule, sizeof(rule));
+    rules_len += sizeof(rule);
+
+    memset(rules + rules_len, 0, padded);
+    memcpy(rules + rules_len, path, len);
+    rules_len += padded;
+
+    rule_count++;
+}
+
+//
+// Sort exact paths before patterns, and each alphabetically.
+//
+static int compare_command(const void *a, const void *b)
+{
+    const char *x = *(char *const *)a;
+    const char *y = *(char *const *)b;
+    int px = matcher_is_pattern(x);
+    int py = matcher_is_pattern(y);
+
+    if (px != py)
+        return px - py;
+
+    return strcmp(x, y);
+}
+
+//
+// Write the index for the given configuration file, which we've read
+// into `commands`.
+//
+// The index is written to a temporary file, then renamed, so the helper
+// never sees a partial index.
+//
+static int write_index(const char *conf, const struct stat *st)
+{
+    struct index_header hdr;
+    char filename[4096];
+    char tmp[4096 + 8];
+    uint32_t offset = 0;
+    void *trie = NULL;
+    size_t trie_len = 0;
+    size_t i, n = 0;
+
+    qsort(commands, command_count, sizeof(*commands), compare_command);
+
+    //
+    // Drop duplicates.
+    //
+    for (i = 0; i < command_count; i++)
+    {
+        if (n > 0 && strcmp(commands[n - 1], commands[i]) == 0)
+        {
+            free(commands[i]);
+            continue;
+        }
+
+        commands[n++] = commands[i];
+    }
+
+    command_count = n;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.conf_size = st->st_size;
+    hdr.conf_mtime_sec = st->st_mtim.tv_sec;
+    hdr.conf_mtime_nsec = st->st_mtim.tv_nsec;
+
+    for (i = 0; i < command_count; i++)
+    {
+        if (matcher_is_pattern(commands[i]))
+            hdr.patterns++;
+        else
+            hdr.count++;
+
+        hdr.strings_len += strlen(commands[i]) + 1;
+    }
+
+    //
+    // Compile the patterns, which are sorted last.
+    //
+    if (hdr.patterns > 0)
+    {
+        struct matcher *m = matcher_new();
+
+        for (i = hdr.count; m && i < command_count; i++)
+        {
+            if (matcher_add(m, commands[i]) != 0)
+                break;
+        }
+
+        if (!m || i < command_count || matcher_serialize(m, &trie, &trie_len) != 0)
+        {
+            fprintf(stderr, "Failed to compile the patterns of %s\n", conf);
+            matcher_free(m);
+            return -1;
+        }
+
+        matcher_free(m);
+        hdr.trie_len = trie_len;
+    }
+
+    snprintf(filename, sizeof(filename), "%.*s.idx", (int)(strlen(conf) - 5), conf);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    FILE *fp = fopen(tmp, "w");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", tmp, strerror(errno));
+        free(trie);
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    for (i = 0; i < command_count; i++)
+    {
+        fwrite(&offset, sizeof(offset), 1, fp);
+        offset += strlen(commands[i]) + 1;
+    }
+
+    if (trie_len)
+        fwrite(trie, trie_len, 1, fp);
+
+    free(trie);
+
+    for (i = 0; i < command_count; i++)
+        fwrite(commands[i], strlen(commands[i]) + 1, 1, fp);
+
+    if (fclose(fp) != 0 || rename(tmp, filename) != 0)
+    {
+        fprintf(stderr, "Failed to write %s: %s\n", filename, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+//
+// Add the rules from the given user's configuration file.
+//
+static int compile_user(const char *dir, const char *name)
+{
+    char user[256];
+    char filename[4096];
+    char buffer[CAN_EXEC_PATH_MAX];
+    size_t len = strlen(name);
+
+    if (len <= 5 || len - 5 >= sizeof(user) || strcmp(name + len - 5, ".conf") != 0)
+        return 0;
+
+    memcpy(user, name, len - 5);
+    user[len - 5] = '\0';
+
+    struct passwd *pwd = getpwnam(user);
+
+    if (pwd == NULL)
+    {
+        fprintf(stderr, "Ignoring %s: no such user %s\n", name, user);
+        return 0;
+    }
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+
+    FILE *fp = fopen(filename, "r");
+
+    if (!fp)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    //
+    // Root is always permitted by the helper, so it needs no index, and
+    // must not be restricted by the kernel.
+    //
+    if (pwd->pw_uid == 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) != 0)
+    {
+        fprintf(stderr, "Failed to stat %s: %s\n", filename, strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+
+    int patterns = 0;
+
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        char *rule = policy_rule(buffer);
+
+        if (!rule)
+            continue;
+
+        patterns |= matcher_is_pattern(rule);
+
+        commands = xrealloc(commands, (command_count + 1) * sizeof(*commands));
+        commands[command_count] = strdup(rule);
+
+        if (!commands[command_count++])
+        {
+            perror("strdup");
+            exit(1);
+        }
+    }
+
+    fclose(fp);
+
+    //
+    // The kernel only handles exact paths, so users with patterns are
+    // left to the daemon, or helper.
+    //
+    if (patterns)
+    {
+        fprintf(stderr, "Not loading %s into the kernel: it contains patterns\n", name);
+    }
+    else
+    {
+        add_uid(pwd->pw_uid);
+
+        for (size_t i = 0; i < command_count; i++)
+            add_rule(pwd->pw_uid, commands[i]);
+    }
+
+    int ret = make_index ? write_index(filename, &st) : 0;
+
+    for (size_t i = 0; i < command_count; i++)
+        free(commands[i]);
+
+    command_count = 0;
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d dir] [-o file] [-l] [-i]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = "/etc/can-exec";
+    const char *output = NULL;
+    int load = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:o:li")) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            dir = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'l':
+            load = 1;
+            break;
+        case 'i':
+            make_index = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (output == NULL && load == 0 && make_index == 0)
+        usage(argv[0]);
+
+    DIR *dp = opendir(dir);
+
+    if (!dp)
+    {
+        fprintf(stderr, "Failed to open %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+
+    struct dirent *de;
+
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (compile_user(dir, de->d_name) != 0)
+            return 1;
+    }
+
+    closedir(dp);
+
+    //
+    // Assemble the policy, which the kernel requires in a single write.
+    //
+    struct can_exec_policy_header hdr =
+    {
+        .magic   = CAN_EXEC_POLICY_MAGIC,
+        .version = CAN_EXEC_POLICY_VERSION,
+        .uids    = uid_count,
+        .rules   = rule_count,
+    };
+    size_t size = sizeof(hdr) + uid_count * sizeof(*uids) + rules_len;
+    char *blob = xrealloc(NULL, size);
+
+    memcpy(blob, &hdr, sizeof(hdr));
+    memcpy(blob + sizeof(hdr), uids, uid_count * sizeof(*uids));
+    memcpy(blob + sizeof(hdr) + uid_count * sizeof(*uids), rules, rules_len);
+
+    const char *targets[] = { output, load ? POLICY : NULL };
+
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++)
+    {
+        if (targets[i] == NULL)
+            continue;
+
+        int fd = open(targets[i], targets[i] == output ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY, 0644);
+
+        if (fd < 0 || write(fd, blob, size) != (ssize_t)size)
+        {
+            fprintf(stderr, "Failed to write %s: %s\n", targets[i], strerror(errno));
+            return 1;
+        }
+
+        close(fd);
+    }
+
+    printf("Compiled %zu rules for %zu users\n", rule_count, uid_count);
+    return 0;
+}
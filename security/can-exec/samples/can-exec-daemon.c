@@ -0,0 +1,540 @@
+/*
+ * Policy daemon for the `can_exec` LSM.
+ *
+ * While this is running the kernel sends it each execution, rather than
+ * running the `can-exec` helper, which saves a fork+exec per command.
+ *
+ * The main thread waits, with epoll, upon the kernel channel
+ * /sys/kernel/security/can-exec/channel, reading requests in batches and
+ * queuing them for a pool of worker threads.  Each worker decides every
+ * request in a batch, then writes all of the verdicts back together.  If
+ * the daemon exits the kernel falls back to the helper.
+ *
+ *   can-exec-daemon [-w workers] [-s seconds]
+ *
+ * -w  The number of worker threads, default one per CPU.
+ * -s  Log statistics every so many seconds, default never.
+ *
+ * Signals:
+ *
+ *   SIGHUP   Reload the policy.  Requests already being decided use the
+ *            old policy, later ones the new.
+ *   SIGUSR1  Log statistics: the number of requests and batches, the
+ *            depth of the queue, and how long requests took to answer.
+ *   SIGTERM  Exit.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include "../can_exec.h"
+#include "policy.h"
+
+#define CHANNEL "/sys/kernel/security/can-exec/channel"
+#define FLUSH   "/proc/sys/kernel/can-exec/cache_flush"
+
+//
+// The number of requests we'll read at once.
+//
+#define BATCH 16
+
+//
+// The number of batches which may be queued, per worker.
+//
+#define QUEUE_PER_WORKER 4
+
+//
+// Service times are recorded in log2 buckets of microseconds.
+//
+#define HIST_BUCKETS 24
+
+
+struct batch
+{
+    size_t count;
+    long start_ns;
+    struct can_exec_request req[BATCH];
+    struct can_exec_reply reply[BATCH];
+};
+
+//
+// The queue of batches read from the kernel, and the free batches.
+//
+// Both are rings of pointers, protected by `lock`.
+//
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER;
+
+static struct batch **queue;
+static size_t queue_head;
+static size_t queue_len;
+
+static struct batch **free_list;
+static size_t free_len;
+
+static size_t capacity;
+
+//
+// The current policy.  Workers take a reference for each batch.
+//
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct policy *current;
+
+static int channel;
+
+//
+// Statistics, updated under `lock`.
+//
+static struct
+{
+    unsigned long requests;
+    unsigned long batches;
+    unsigned long denied;
+    size_t queue_max;
+    long service_total_ns;
+    long service_max_ns;
+    unsigned long hist[HIST_BUCKETS];
+} stats;
+
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//
+// Discard any verdicts the kernel has cached, as the policy has changed.
+//
+static void flush_kernel_cache(void)
+{
+    int fd = open(FLUSH, O_WRONLY);
+
+    if (fd < 0 || write(fd, "1", 1) != 1)
+        logger("Failed to flush %s: %s", FLUSH, strerror(errno));
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static struct policy *get_policy(void)
+{
+    struct policy *p;
+
+    pthread_mutex_lock(&policy_lock);
+    p = current;
+    policy_get(p);
+    pthread_mutex_unlock(&policy_lock);
+
+    return p;
+}
+
+static void reload_policy(void)
+{
+    struct policy *p = policy_new();
+    struct policy *old;
+
+    if (!p)
+    {
+        logger("Failed to allocate policy: keeping the old one");
+        return;
+    }
+
+    pthread_mutex_lock(&policy_lock);
+    old = current;
+    current = p;
+    pthread_mutex_unlock(&policy_lock);
+
+    policy_put(old);
+    flush_kernel_cache();
+    logger("Reloaded policy");
+}
+
+static void log_stats(void)
+{
+    unsigned long seen = 0;
+    long p99_us = 0;
+
+    pthread_mutex_lock(&lock);
+
+    //
+    // The upper bound of the bucket holding the 99th percentile.
+    //
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += stats.hist[i];
+
+        if (seen * 100 >= stats.requests * 99)
+        {
+            p99_us = 1L << i;
+            break;
+        }
+    }
+
+    logger("requests=%lu denied=%lu batches=%lu queue_depth=%zu queue_max=%zu "
+           "service_avg_us=%.1f service_p99_us<=%ld service_max_us=%.1f",
+           stats.requests, stats.denied, stats.batches, queue_len, stats.queue_max,
+           stats.requests ? stats.service_total_ns / 1e3 / stats.requests : 0.0,
+           p99_us, stats.service_max_ns / 1e3);
+
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        struct batch *b;
+
+        pthread_mutex_lock(&lock);
+
+        while (queue_len == 0)
+            pthread_cond_wait(&queued, &lock);
+
+        b = queue[queue_head];
+        queue_head = (queue_head + 1) % capacity;
+        queue_len--;
+
+        pthread_mutex_unlock(&lock);
+
+        struct policy *p = get_policy();
+        unsigned long denied = 0;
+
+        for (size_t i = 0; i < b->count; i++)
+        {
+            struct can_exec_request *req = &b->req[i];
+
+            b->reply[i].id = req->id;
+            b->reply[i].reserved = 0;
+
+            //
+            // A path the task saw in its own mount namespace may name
+            // any file, so it must lead to the one being executed.
+            //
+            if ((req->flags & CAN_EXEC_REQUEST_LOCAL_PATH) &&
+                !policy_path_matches(req->path, req->dev, req->ino))
+            {
+                logger("Denying execution of %s by UID %d - path doesn't lead to the file executed",
+                       req->path, req->uid);
+                b->reply[i].verdict = -1;
+            }
+            else
+            {
+                b->reply[i].verdict = policy_check_with(p, req->uid, req->path);
+            }
+
+            if (b->reply[i].verdict != 0)
+                denied++;
+        }
+
+        policy_put(p);
+
+        if (write(channel, b->reply, b->count * sizeof(b->reply[0])) < 0)
+            logger("Failed to write replies: %s", strerror(errno));
+
+        long service = now_ns() - b->start_ns;
+        int bucket = 0;
+
+        while (bucket < HIST_BUCKETS - 1 && (1L << bucket) * 1000 < service)
+            bucket++;
+
+        pthread_mutex_lock(&lock);
+
+        stats.requests += b->count;
+        stats.denied += denied;
+        stats.batches++;
+        stats.service_total_ns += service * b->count;
+        stats.hist[bucket] += b->count;
+
+        if (service > stats.service_max_ns)
+            stats.service_max_ns = service;
+
+        free_list[free_len++] = b;
+        pthread_cond_signal(&freed);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+//
+// Read every pending request from the kernel, and queue them.
+//
+// Returns -1 if the channel failed.
+//
+static int read_requests(void)
+{
+    for (;;)
+    {
+        struct batch *b;
+
+        pthread_mutex_lock(&lock);
+
+        while (free_len == 0)
+            pthread_cond_wait(&freed, &lock);
+
+        b = free_list[--free_len];
+        pthread_mutex_unlock(&lock);
+
+        ssize_t n = read(channel, b->req, sizeof(b->req));
+
+        if (n <= 0)
+        {
+            pthread_mutex_lock(&lock);
+            free_list[free_len++] = b;
+            pthread_mutex_unlock(&lock);
+
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return 0;
+
+            logger("Failed to read requests: %s", strerror(errno));
+            return -1;
+        }
+
+        b->count = n / sizeof(b->req[0]);
+        b->start_ns = now_ns();
+
+        pthread_mutex_lock(&lock);
+
+        queue[(queue_head + queue_len) % capacity] = b;
+        queue_len++;
+
+        if (queue_len > stats.queue_max)
+            stats.queue_max = queue_len;
+
+        pthread_cond_signal(&queued);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int interval = 0;
+    int ret = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "w:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'w':
+            workers = atol(optarg);
+            break;
+        case 's':
+            interval = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers] [-s seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (workers < 1)
+        workers = 1;
+
+    openlog("can-exec-daemon", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
+
+    //
+    // Signals are handled by the main loop, so block them in every thread.
+    //
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    channel = open(CHANNEL, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (channel < 0 || sfd < 0)
+    {
+        logger("Failed to open %s: %s", CHANNEL, strerror(errno));
+        return 1;
+    }
+
+    current = policy_new();
+    capacity = workers * QUEUE_PER_WORKER;
+    queue = calloc(capacity, sizeof(*queue));
+    free_list = calloc(capacity, sizeof(*free_list));
+
+    if (!current || !queue || !free_list)
+    {
+        logger("Failed to allocate memory");
+        return 1;
+    }
+
+    for (size_t i = 0; i < capacity; i++)
+    {
+        free_list[free_len] = malloc(sizeof(struct batch));
+
+        if (!free_list[free_len++])
+        {
+            logger("Failed to allocate memory");
+            return 1;
+        }
+    }
+
+    //
+    // The policy may have changed while we weren't running, so discard
+    // anything the kernel has cached.
+    //
+    flush_kernel_cache();
+
+    for (long i = 0; i < workers; i++)
+    {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0)
+        {
+            logger("Failed to start worker: %s", strerror(errno));
+            return 1;
+        }
+
+        pthread_detach(thread);
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    if (epfd < 0)
+    {
+        logger("Failed to create epoll instance: %s", strerror(errno));
+        return 1;
+    }
+
+    ev.data.fd = channel;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, channel, &ev) != 0)
+    {
+        logger("Failed to watch %s: %s", CHANNEL, strerror(errno));
+        return 1;
+    }
+
+    ev.data.fd = sfd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) != 0)
+    {
+        logger("Failed to watch for signals: %s", strerror(errno));
+        return 1;
+    }
+
+    int tfd = -1;
+
+    if (interval > 0)
+    {
+        struct itimerspec its =
+        {
+            .it_interval = { .tv_sec = interval },
+            .it_value = { .tv_sec = interval },
+        };
+
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+        if (tfd < 0 || timerfd_settime(tfd, 0, &its, NULL) != 0)
+        {
+            logger("Failed to start the statistics timer: %s", strerror(errno));
+            return 1;
+        }
+
+        ev.data.fd = tfd;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) != 0)
+        {
+            logger("Failed to watch the statistics timer: %s", strerror(errno));
+            return 1;
+        }
+    }
+
+    logger("Serving requests from %s with %ld workers", CHANNEL, workers);
+
+    for (;;)
+    {
+        struct epoll_event events[4];
+        int n = epoll_wait(epfd, events, 4, -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            logger("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            int fd = events[i].data.fd;
+
+            if (fd == channel)
+            {
+                if (read_requests() != 0)
+                    goto out;
+            }
+            else if (fd == tfd)
+            {
+                uint64_t expirations;
+
+                if (read(tfd, &expirations, sizeof(expirations)) > 0)
+                    log_stats();
+            }
+            else if (fd == sfd)
+            {
+                struct signalfd_siginfo si;
+
+                if (read(sfd, &si, sizeof(si)) != sizeof(si))
+                    continue;
+
+                switch (si.ssi_signo)
+                {
+                case SIGHUP:
+                    reload_policy();
+                    break;
+                case SIGUSR1:
+                    log_stats();
+                    break;
+                default:
+                    logger("Exiting on signal %d", si.ssi_signo);
+                    log_stats();
+                    ret = 0;
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    //
+    // Closing the channel hands any outstanding requests to the helper.
+    //
+    close(channel);
+    closelog();
+    return ret;
+}
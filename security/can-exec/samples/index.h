@@ -0,0 +1,45 @@
+/*
+ * The per-user index files written by `can-exec-compile -i`.
+ *
+ * /etc/can-exec/$USERNAME.idx holds the commands from $USERNAME.conf,
+ * sorted, so the helper can `mmap()` it and binary-search rather than
+ * parsing the configuration file on every execution.
+ *
+ * The layout is a header, `count + patterns` offsets into the string
+ * table, the compiled patterns, and then the string table of
+ * NUL-terminated rules.  The first `count` offsets refer to the exact
+ * paths, in sorted order, and the remainder to the patterns, which are
+ * described in `matcher.h`.
+ *
+ * The patterns are also stored as a trie, `trie_len` bytes long, as
+ * written by matcher_serialize(), so the helper can match them in place
+ * rather than compiling them on every execution.  `trie_len` is zero if
+ * there are no patterns.
+ *
+ * The index records the size and modification time of the configuration
+ * file it was built from, and is ignored once that no longer matches.
+ *
+ * Steve
+ * --
+ */
+
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include <stdint.h>
+
+#define INDEX_MAGIC "CXIDX03"
+
+struct index_header
+{
+    char magic[8];
+    uint64_t conf_size;
+    int64_t conf_mtime_sec;
+    int64_t conf_mtime_nsec;
+    uint32_t count;
+    uint32_t patterns;
+    uint32_t strings_len;
+    uint32_t trie_len;
+};
+
+#endif
@@ -0,0 +1,251 @@
+/*
+ * Microbenchmark for the rule matcher used by the `can_exec` helper.
+ *
+ * Generates a large rule-set, mostly exact paths plus some patterns, and
+ * times lookups against the compiled trie, and against a linear scan
+ * which compares the path with each rule in turn:
+ *
+ *   matcher-bench [-r rules] [-n lookups]
+ *
+ * The linear scan uses fnmatch(3) without FNM_PATHNAME, so `*` may match
+ * `/`.  That differs from the matcher in general, but not for the rules
+ * and paths generated here, and the benchmark checks both agree.
+ *
+ * Finally it times a rule alternating `**` and `a`, against a deep path of
+ * `a` which almost matches it, which would take time exponential in the
+ * depth of the path without memoization.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "matcher.h"
+
+
+static long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//
+// The i-th rule: one in ten is a pattern.
+//
+static void make_rule(char *buf, size_t len, long i)
+{
+    switch (i % 10)
+    {
+    case 0:
+        snprintf(buf, len, "/opt/pkg%ld/lib/**", i / 10);
+        break;
+    case 5:
+        snprintf(buf, len, "/srv/app%ld/bin/run-*", i / 10);
+        break;
+    default:
+        snprintf(buf, len, "/usr/lib/pkg%ld/bin/tool%ld", i / 10, i);
+        break;
+    }
+}
+
+//
+// A path to look up, about half of which are permitted.
+//
+static void make_path(char *buf, size_t len, long rules)
+{
+    long i = random() % rules;
+
+    switch (random() % 6)
+    {
+    case 0:
+        snprintf(buf, len, "/opt/pkg%ld/lib/jvm/bin/java", i / 10);
+        break;
+    case 1:
+        snprintf(buf, len, "/srv/app%ld/bin/run-server", i / 10);
+        break;
+    case 2:
+        snprintf(buf, len, "/usr/lib/pkg%ld/bin/tool%ld", i / 10, i);
+        break;
+    case 3:
+        snprintf(buf, len, "/usr/lib/pkg%ld/bin/missing%ld", i / 10, i);
+        break;
+    case 4:
+        snprintf(buf, len, "/srv/app%ld/sbin/run-server", i / 10);
+        break;
+    default:
+        snprintf(buf, len, "/home/user/bin/tool%ld", i);
+        break;
+    }
+}
+
+static int linear_match(char **rules, long count, const char *path)
+{
+    for (long i = 0; i < count; i++)
+    {
+        if (fnmatch(rules[i], path, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+//
+// Time the rule below against a path of `depth` copies of `/a`, which
+// must be refused, and the same with `/b` appended, which must be
+// permitted, both in the trie and in its image.
+//
+static int pathological(int depth)
+{
+    const char *rule = "/**/a/**/a/**/a/**/a/**/a/**/b";
+    struct matcher *m = matcher_new();
+    char path[1024];
+    size_t len = 0;
+    void *image;
+    size_t image_len;
+
+    if (!m || matcher_add(m, rule) != 0)
+        return 1;
+
+    for (int i = 0; i < depth && len + 3 < sizeof(path); i++)
+        len += snprintf(path + len, sizeof(path) - len, "/a");
+
+    if (matcher_serialize(m, &image, &image_len) != 0)
+        return 1;
+
+    long start = now_ns();
+    int refused = matcher_match(m, path);
+    int refused_image = matcher_match_image(image, image_len, path);
+
+    snprintf(path + len, sizeof(path) - len, "/b");
+
+    int permitted = matcher_match(m, path);
+    int permitted_image = matcher_match_image(image, image_len, path);
+    long elapsed = now_ns() - start;
+
+    if (refused != 0 || refused_image != 0 || permitted != 1 || permitted_image != 1)
+    {
+        fprintf(stderr, "Wrong result for %s against a path of depth %d\n", rule, depth);
+        return 1;
+    }
+
+    printf("rule=%s depth=%d total_us=%.1f\n", rule, depth, elapsed / 1e3);
+
+    free(image);
+    matcher_free(m);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long count = 10000;
+    long lookups = 10000;
+    char buf[256];
+    int c;
+
+    while ((c = getopt(argc, argv, "r:n:")) != -1)
+    {
+        switch (c)
+        {
+        case 'r':
+            count = atol(optarg);
+            break;
+        case 'n':
+            lookups = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rules] [-n lookups]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (count < 10 || lookups < 1)
+        return 1;
+
+    char **rules = calloc(count, sizeof(char *));
+    char **paths = calloc(lookups, sizeof(char *));
+    int *expected = calloc(lookups, sizeof(int));
+    struct matcher *m = matcher_new();
+
+    if (!rules || !paths || !expected || !m)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    for (long i = 0; i < count; i++)
+    {
+        make_rule(buf, sizeof(buf), i);
+        rules[i] = strdup(buf);
+    }
+
+    srandom(1);
+
+    for (long i = 0; i < lookups; i++)
+    {
+        make_path(buf, sizeof(buf), count);
+        paths[i] = strdup(buf);
+    }
+
+    //
+    // Build the trie.
+    //
+    long start = now_ns();
+
+    for (long i = 0; i < count; i++)
+    {
+        if (matcher_add(m, rules[i]) != 0)
+        {
+            fprintf(stderr, "Failed to add %s\n", rules[i]);
+            return 1;
+        }
+    }
+
+    matcher_finish(m);
+    long build = now_ns() - start;
+
+    //
+    // The linear scan is slow, so we time fewer lookups with it.
+    //
+    long linear_lookups = lookups < 1000 ? lookups : 1000;
+
+    start = now_ns();
+
+    for (long i = 0; i < linear_lookups; i++)
+        expected[i] = linear_match(rules, count, paths[i]);
+
+    long linear = now_ns() - start;
+
+    long allowed = 0;
+    start = now_ns();
+
+    for (long i = 0; i < lookups; i++)
+        allowed += matcher_match(m, paths[i]);
+
+    long trie = now_ns() - start;
+
+    for (long i = 0; i < linear_lookups; i++)
+    {
+        if (matcher_match(m, paths[i]) != expected[i])
+        {
+            fprintf(stderr, "Mismatch for %s: linear scan says %d\n", paths[i], expected[i]);
+            return 1;
+        }
+    }
+
+    printf("rules=%ld lookups=%ld allowed=%ld build_ms=%.1f trie_ns=%.0f linear_ns=%.0f\n",
+           count, lookups, allowed, build / 1e6,
+           (double)trie / lookups, (double)linear / linear_lookups);
+
+    matcher_free(m);
+    return pathological(80);
+}
@@ -0,0 +1,804 @@
+/*
+ * Match paths against a set of rules, for the `can_exec` helper.
+ *
+ * Each node of the trie holds its literal children sorted, so they can be
+ * binary-searched, its wildcard children, which must each be tried, and
+ * at most one `**` child.
+ *
+ * While the trie is being built each node's literal children are left
+ * unsorted, and found via a hash table keyed on (parent, name), so adding
+ * tens of thousands of rules beneath one directory stays cheap.  The
+ * children are sorted by matcher_finish(), or on the first match.
+ *
+ * A path may reach the same node at the same component by many routes
+ * through a series of `**`, and without care a rule alternating `**` and
+ * `a` several times takes time exponential in the depth of a path made up
+ * of many `a`.  So each match remembers, for every node with a `**` child,
+ * the lowest component from which that `**` has already failed to match
+ * the rest of the path - it must fail from any later component too - and
+ * never tries those again.  The time taken is then proportional to the
+ * number of components, for each node the path can reach.
+ *
+ * A finished trie may be flattened into an image, so the one-shot helper
+ * can walk it straight from an mmap()ed index.  Each node of the image is
+ * a `struct image_node`, followed by the offsets of its sorted literal
+ * children then its wildcard children, then its NUL-terminated name,
+ * padded to four bytes.  The root is at offset zero, and nodes are written
+ * parent first, so every child lies beyond its parent - which, when
+ * checked, stops a corrupt image from sending us round in circles.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matcher.h"
+
+
+struct node
+{
+    char *name;
+    int terminal;
+
+    struct node **literal;
+    size_t nliteral;
+    size_t aliteral;
+
+    struct node **pattern;
+    size_t npattern;
+    size_t apattern;
+
+    struct node *any;
+};
+
+struct image_node
+{
+    uint32_t terminal;
+    uint32_t nliteral;
+    uint32_t npattern;
+    uint32_t any;               // 0 if none
+    uint32_t child[];
+};
+
+struct image
+{
+    const char *data;
+    size_t len;
+};
+
+struct image_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+//
+// node -> the lowest component from which its `**` failed, during one match.
+//
+struct memo_slot
+{
+    const void *node;           // NULL if unused
+    size_t from;
+};
+
+struct memo
+{
+    struct memo_slot *slot;
+    size_t size;
+    size_t used;
+};
+
+struct matcher
+{
+    struct node root;
+
+    //
+    // (parent, name) -> node, for building.
+    //
+    struct node **table;
+    size_t table_size;
+    size_t table_used;
+
+    int sorted;
+};
+
+
+static uint64_t hash_child(const struct node *parent, const char *name, size_t len)
+{
+    uint64_t h = 1469598103934665603ULL ^ (uintptr_t)parent;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+
+    return h;
+}
+
+//
+// Find the slot for the named child of `parent` in the build table.
+//
+// Each slot is a pair of (child, parent) pointers.
+//
+static struct node **table_slot(struct matcher *m, const struct node *parent,
+                                const char *name, size_t len)
+{
+    size_t mask = m->table_size - 1;
+    size_t i = hash_child(parent, name, len) & mask;
+
+    for (;;)
+    {
+        struct node **slot = &m->table[i * 2];
+
+        if (slot[0] == NULL)
+            return slot;
+
+        if (slot[1] == parent &&
+            strncmp(slot[0]->name, name, len) == 0 && slot[0]->name[len] == '\0')
+            return slot;
+
+        i = (i + 1) & mask;
+    }
+}
+
+static int table_grow(struct matcher *m)
+{
+    struct node **old = m->table;
+    size_t old_size = m->table_size;
+
+    m->table_size = old_size ? old_size * 2 : 1024;
+    m->table = calloc(m->table_size * 2, sizeof(struct node *));
+
+    if (!m->table)
+    {
+        m->table = old;
+        m->table_size = old_size;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_size; i++)
+    {
+        struct node *child = old[i * 2];
+        struct node *parent = old[i * 2 + 1];
+
+        if (child)
+        {
+            struct node **slot = table_slot(m, parent, child->name, strlen(child->name));
+
+            slot[0] = child;
+            slot[1] = parent;
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+static struct memo_slot *memo_slot(const struct memo *memo, const void *node)
+{
+    size_t mask = memo->size - 1;
+    size_t k = ((uintptr_t)node >> 3) * 0x9e3779b97f4a7c15ULL & mask;
+
+    for (;;)
+    {
+        struct memo_slot *slot = &memo->slot[k];
+
+        if (slot->node == NULL || slot->node == node)
+            return slot;
+
+        k = (k + 1) & mask;
+    }
+}
+
+//
+// The lowest component from which the `**` beneath the given node has
+// failed to match, or `count` + 1 if it hasn't yet.
+//
+static size_t memo_failed(const struct memo *memo, const void *node, size_t count)
+{
+    const struct memo_slot *slot;
+
+    if (memo->size == 0)
+        return count + 1;
+
+    slot = memo_slot(memo, node);
+    return slot->node ? slot->from : count + 1;
+}
+
+//
+// Record that the `**` beneath the given node failed from component `from`.
+//
+// If we can't allocate the memory we simply don't remember it, which costs
+// time but not correctness.
+//
+static void memo_fail(struct memo *memo, const void *node, size_t from)
+{
+    if (memo->used * 2 >= memo->size)
+    {
+        struct memo old = *memo;
+
+        memo->size = old.size ? old.size * 2 : 64;
+        memo->slot = calloc(memo->size, sizeof(*memo->slot));
+
+        if (!memo->slot)
+        {
+            *memo = old;
+
+            if (memo->used * 2 >= memo->size)
+                return;
+        }
+        else
+        {
+            for (size_t k = 0; k < old.size; k++)
+                if (old.slot[k].node)
+                    *memo_slot(memo, old.slot[k].node) = old.slot[k];
+
+            free(old.slot);
+        }
+    }
+
+    struct memo_slot *slot = memo_slot(memo, node);
+
+    if (!slot->node)
+    {
+        slot->node = node;
+        memo->used++;
+    }
+
+    slot->from = from;
+}
+
+static struct node *node_new(const char *name, size_t len)
+{
+    struct node *n = calloc(1, sizeof(*n));
+
+    if (!n)
+        return NULL;
+
+    n->name = strndup(name, len);
+
+    if (!n->name)
+    {
+        free(n);
+        return NULL;
+    }
+
+    return n;
+}
+
+static int push(struct node ***array, size_t *count, size_t *alloc, struct node *n)
+{
+    if (*count == *alloc)
+    {
+        size_t size = *alloc ? *alloc * 2 : 4;
+        struct node **tmp = realloc(*array, size * sizeof(*tmp));
+
+        if (!tmp)
+            return -1;
+
+        *array = tmp;
+        *alloc = size;
+    }
+
+    (*array)[(*count)++] = n;
+    return 0;
+}
+
+static int is_pattern(const char *name, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (name[i] == '*' || name[i] == '?' || name[i] == '[')
+            return 1;
+
+    return 0;
+}
+
+int matcher_is_pattern(const char *rule)
+{
+    return is_pattern(rule, strlen(rule));
+}
+
+//
+// Find, or create, the child of `parent` for the given component.
+//
+static struct node *child(struct matcher *m, struct node *parent, const char *name, size_t len)
+{
+    struct node *n;
+
+    if (len == 2 && name[0] == '*' && name[1] == '*')
+    {
+        if (!parent->any)
+            parent->any = node_new(name, len);
+
+        return parent->any;
+    }
+
+    if (is_pattern(name, len))
+    {
+        for (size_t i = 0; i < parent->npattern; i++)
+        {
+            n = parent->pattern[i];
+
+            if (strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+                return n;
+        }
+
+        n = node_new(name, len);
+
+        if (!n || push(&parent->pattern, &parent->npattern, &parent->apattern, n) != 0)
+            return NULL;
+
+        return n;
+    }
+
+    if (m->table_used * 2 >= m->table_size && table_grow(m) != 0)
+        return NULL;
+
+    struct node **slot = table_slot(m, parent, name, len);
+
+    if (slot[0])
+        return slot[0];
+
+    n = node_new(name, len);
+
+    if (!n || push(&parent->literal, &parent->nliteral, &parent->aliteral, n) != 0)
+        return NULL;
+
+    slot[0] = n;
+    slot[1] = parent;
+    m->table_used++;
+    m->sorted = 0;
+    return n;
+}
+
+struct matcher *matcher_new(void)
+{
+    struct matcher *m = calloc(1, sizeof(*m));
+
+    if (m && table_grow(m) != 0)
+    {
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+int matcher_add(struct matcher *m, const char *rule)
+{
+    struct node *n = &m->root;
+    const char *p = rule;
+
+    while (*p)
+    {
+        size_t len;
+
+        while (*p == '/')
+            p++;
+
+        len = strcspn(p, "/");
+
+        if (len == 0)
+            break;
+
+        n = child(m, n, p, len);
+
+        if (!n)
+            return -1;
+
+        p += len;
+    }
+
+    n->terminal = 1;
+    return 0;
+}
+
+static int compare_node(const void *a, const void *b)
+{
+    return strcmp((*(struct node *const *)a)->name, (*(struct node *const *)b)->name);
+}
+
+static void sort_node(struct node *n)
+{
+    qsort(n->literal, n->nliteral, sizeof(*n->literal), compare_node);
+
+    for (size_t i = 0; i < n->nliteral; i++)
+        sort_node(n->literal[i]);
+
+    for (size_t i = 0; i < n->npattern; i++)
+        sort_node(n->pattern[i]);
+
+    if (n->any)
+        sort_node(n->any);
+}
+
+static struct node *find_literal(const struct node *n, const char *name)
+{
+    size_t lo = 0;
+    size_t hi = n->nliteral;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, n->literal[mid]->name);
+
+        if (cmp == 0)
+            return n->literal[mid];
+
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return NULL;
+}
+
+static int match_node(const struct node *n, char **comp, size_t i, size_t count,
+                      struct memo *memo)
+{
+    //
+    // `**` may consume any number of the remaining components.
+    //
+    if (n->any)
+    {
+        size_t failed = memo_failed(memo, n, count);
+
+        if (i < failed)
+        {
+            for (size_t j = i; j < failed && j <= count; j++)
+                if (match_node(n->any, comp, j, count, memo))
+                    return 1;
+
+            memo_fail(memo, n, i);
+        }
+    }
+
+    if (i == count)
+        return n->terminal;
+
+    struct node *lit = find_literal(n, comp[i]);
+
+    if (lit && match_node(lit, comp, i + 1, count, memo))
+        return 1;
+
+    for (size_t k = 0; k < n->npattern; k++)
+    {
+        if (fnmatch(n->pattern[k]->name, comp[i], 0) == 0 &&
+            match_node(n->pattern[k], comp, i + 1, count, memo))
+            return 1;
+    }
+
+    return 0;
+}
+
+//
+// Split a path into its components, in place.
+//
+// Returns the number of components, or -1 if there are too many.
+//
+static int split_path(char *path, char **comp, size_t max)
+{
+    char *save = NULL;
+    size_t count = 0;
+
+    for (char *tok = strtok_r(path, "/", &save); tok; tok = strtok_r(NULL, "/", &save))
+    {
+        if (count == max)
+            return -1;
+
+        comp[count++] = tok;
+    }
+
+    return count;
+}
+
+void matcher_finish(struct matcher *m)
+{
+    if (!m->sorted)
+    {
+        sort_node(&m->root);
+        m->sorted = 1;
+    }
+}
+
+int matcher_match(struct matcher *m, const char *path)
+{
+    char *copy = strdup(path);
+    char *comp[256];
+    struct memo memo = { NULL, 0, 0 };
+    int count;
+    int ret = 0;
+
+    if (!copy)
+        return 0;
+
+    matcher_finish(m);
+
+    count = split_path(copy, comp, sizeof(comp) / sizeof(comp[0]));
+
+    if (count >= 0)
+        ret = match_node(&m->root, comp, 0, count, &memo);
+
+    free(memo.slot);
+    free(copy);
+    return ret;
+}
+
+//
+// Append `size` zeroed bytes to the image, returning their offset.
+//
+static long image_reserve(struct image_buf *b, size_t size)
+{
+    size_t off = b->len;
+
+    if (b->len + size > UINT32_MAX)
+        return -1;
+
+    while (b->len + size > b->size)
+    {
+        size_t alloc = b->size ? b->size * 2 : 4096;
+        char *tmp = realloc(b->data, alloc);
+
+        if (!tmp)
+            return -1;
+
+        b->data = tmp;
+        b->size = alloc;
+    }
+
+    memset(b->data + off, 0, size);
+    b->len += size;
+    return off;
+}
+
+static int image_set_child(struct image_buf *b, long off, size_t i, long child)
+{
+    struct image_node *in = (struct image_node *)(b->data + off);
+
+    if (child < 0)
+        return -1;
+
+    in->child[i] = child;
+    return 0;
+}
+
+static long serialize_node(struct image_buf *b, const struct node *n)
+{
+    const char *name = n->name ? n->name : "";
+    size_t nchild = n->nliteral + n->npattern;
+    size_t name_len = (strlen(name) + 1 + 3) & ~(size_t)3;
+    long off = image_reserve(b, sizeof(struct image_node) + nchild * sizeof(uint32_t) + name_len);
+
+    if (off < 0)
+        return -1;
+
+    struct image_node *in = (struct image_node *)(b->data + off);
+
+    in->terminal = n->terminal;
+    in->nliteral = n->nliteral;
+    in->npattern = n->npattern;
+    strcpy((char *)&in->child[nchild], name);
+
+    for (size_t i = 0; i < n->nliteral; i++)
+        if (image_set_child(b, off, i, serialize_node(b, n->literal[i])) != 0)
+            return -1;
+
+    for (size_t i = 0; i < n->npattern; i++)
+        if (image_set_child(b, off, n->nliteral + i, serialize_node(b, n->pattern[i])) != 0)
+            return -1;
+
+    if (n->any)
+    {
+        long any = serialize_node(b, n->any);
+
+        if (any < 0)
+            return -1;
+
+        ((struct image_node *)(b->data + off))->any = any;
+    }
+
+    return off;
+}
+
+int matcher_serialize(struct matcher *m, void **image, size_t *len)
+{
+    struct image_buf b = { NULL, 0, 0 };
+
+    matcher_finish(m);
+
+    if (serialize_node(&b, &m->root) < 0)
+    {
+        free(b.data);
+        return -1;
+    }
+
+    *image = b.data;
+    *len = b.len;
+    return 0;
+}
+
+//
+// Find the node at the given offset, which must lie beyond `min`, and its
+// name, or return NULL if it doesn't fit within the image.
+//
+static const struct image_node *image_node(const struct image *img, uint32_t off,
+                                           size_t min, const char **name)
+{
+    const struct image_node *in;
+    size_t left;
+
+    if (off % 4 != 0 || off < min || off > img->len ||
+        img->len - off < sizeof(*in))
+        return NULL;
+
+    in = (const struct image_node *)(img->data + off);
+    left = (img->len - off - sizeof(*in)) / sizeof(uint32_t);
+
+    if (in->nliteral > left || in->npattern > left - in->nliteral)
+        return NULL;
+
+    *name = (const char *)&in->child[in->nliteral + in->npattern];
+
+    if (!memchr(*name, '\0', img->data + img->len - *name))
+        return NULL;
+
+    return in;
+}
+
+//
+// As find_literal(), but within an image.
+//
+static int image_find_literal(const struct image *img, const struct image_node *n,
+                              size_t min, const char *name, const struct image_node **found)
+{
+    size_t lo = 0;
+    size_t hi = n->nliteral;
+
+    *found = NULL;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *mid_name;
+        const struct image_node *c = image_node(img, n->child[mid], min, &mid_name);
+
+        if (!c)
+            return -1;
+
+        int cmp = strcmp(name, mid_name);
+
+        if (cmp == 0)
+        {
+            *found = c;
+            return 0;
+        }
+
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return 0;
+}
+
+//
+// As match_node(), but within an image, returning -1 if it is corrupt.
+//
+static int match_image_node(const struct image *img, const struct image_node *n,
+                            char **comp, size_t i, size_t count, struct memo *memo)
+{
+    size_t min = (const char *)n - img->data + sizeof(*n);
+    const struct image_node *c;
+    const char *name;
+    int ret;
+
+    if (n->any)
+    {
+        if (!(c = image_node(img, n->any, min, &name)))
+            return -1;
+
+        size_t failed = memo_failed(memo, n, count);
+
+        if (i < failed)
+        {
+            for (size_t j = i; j < failed && j <= count; j++)
+                if ((ret = match_image_node(img, c, comp, j, count, memo)) != 0)
+                    return ret;
+
+            memo_fail(memo, n, i);
+        }
+    }
+
+    if (i == count)
+        return n->terminal != 0;
+
+    if (image_find_literal(img, n, min, comp[i], &c) != 0)
+        return -1;
+
+    if (c && (ret = match_image_node(img, c, comp, i + 1, count, memo)) != 0)
+        return ret;
+
+    for (size_t k = 0; k < n->npattern; k++)
+    {
+        if (!(c = image_node(img, n->child[n->nliteral + k], min, &name)))
+            return -1;
+
+        if (fnmatch(name, comp[i], 0) == 0 &&
+            (ret = match_image_node(img, c, comp, i + 1, count, memo)) != 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+int matcher_match_image(const void *image, size_t len, const char *path)
+{
+    struct image img = { image, len };
+    const struct image_node *root;
+    const char *name;
+    char *copy;
+    char *comp[256];
+    struct memo memo = { NULL, 0, 0 };
+    int count;
+    int ret = 0;
+
+    if (!(root = image_node(&img, 0, 0, &name)))
+        return -1;
+
+    if (!(copy = strdup(path)))
+        return -1;
+
+    count = split_path(copy, comp, sizeof(comp) / sizeof(comp[0]));
+
+    if (count >= 0)
+        ret = match_image_node(&img, root, comp, 0, count, &memo);
+
+    free(memo.slot);
+    free(copy);
+    return ret;
+}
+
+//
+// Free the children of the given node.
+//
+static void free_children(struct node *n)
+{
+    for (size_t i = 0; i < n->nliteral; i++)
+    {
+        free_children(n->literal[i]);
+        free(n->literal[i]);
+    }
+
+    for (size_t i = 0; i < n->npattern; i++)
+    {
+        free_children(n->pattern[i]);
+        free(n->pattern[i]);
+    }
+
+    if (n->any)
+    {
+        free_children(n->any);
+        free(n->any);
+    }
+
+    free(n->literal);
+    free(n->pattern);
+    free(n->name);
+}
+
+void matcher_free(struct matcher *m)
+{
+    if (!m)
+        return;
+
+    free_children(&m->root);
+    free(m->table);
+    free(m);
+}
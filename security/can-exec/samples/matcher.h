@@ -0,0 +1,75 @@
+/*
+ * Match paths against a set of rules, for the `can_exec` helper.
+ *
+ * A rule is either a path, which must match exactly, or a pattern.
+ * Within a component `*`, `?` and `[...]` have their usual meaning, and
+ * never match `/`.  A component which is exactly `**` matches any number
+ * of components, including none.  For example:
+ *
+ *   /usr/local/bin/gcc-?    Any single-digit version of gcc.
+ *   /usr/lib/jvm/ **        Anything beneath /usr/lib/jvm (without the space).
+ *
+ * The rules are compiled into a trie of path components, so matching
+ * costs time proportional to the length of the path, rather than the
+ * number of rules.
+ *
+ * Steve
+ * --
+ */
+
+#ifndef _MATCHER_H
+#define _MATCHER_H
+
+#include <stddef.h>
+
+struct matcher;
+
+//
+// Create an empty matcher, returning NULL on failure.
+//
+struct matcher *matcher_new(void);
+
+//
+// Add a rule, returning 0 on success.
+//
+int matcher_add(struct matcher *m, const char *rule);
+
+//
+// Prepare the matcher for lookups, once all the rules have been added.
+//
+// After this matcher_match() doesn't modify the matcher, so may be called
+// from several threads at once.
+//
+void matcher_finish(struct matcher *m);
+
+//
+// Does the given path match any of the rules?
+//
+// Returns 1 if so, 0 if not.
+//
+int matcher_match(struct matcher *m, const char *path);
+
+void matcher_free(struct matcher *m);
+
+//
+// Does the rule contain any wildcards?
+//
+int matcher_is_pattern(const char *rule);
+
+//
+// Serialize the compiled trie into a flat image, which may be written to
+// a file and later matched against, in place, by matcher_match_image().
+//
+// On success `*image` is allocated with malloc(), and 0 is returned.
+//
+int matcher_serialize(struct matcher *m, void **image, size_t *len);
+
+//
+// As matcher_match(), but against an image from matcher_serialize(),
+// which must be aligned to four bytes.
+//
+// Returns 1 if the path matches, 0 if not, or -1 if the image is corrupt.
+//
+int matcher_match_image(const void *image, size_t len, const char *path);
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Policy decisions for the `can_exec` LSM.
+ *
+ * The user may execute a command if it is listed in the file
+ * /etc/can-exec/$USERNAME.conf, otherwise execution is denied.
+ *
+ * Each line of that file is a path, or a pattern as described in
+ * `matcher.h`, optionally prefixed by "allow ".
+ *
+ * If `can-exec-compile -i` has written an up to date index of that file,
+ * /etc/can-exec/$USERNAME.idx, then we search that instead.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pwd.h>
+#include <pthread.h>
+
+#include "index.h"
+#include "matcher.h"
+#include "policy.h"
+
+
+// Log a message to STDERR for testing, and to syslog for production use.
+void logger(const char *format, ...)
+{
+    char buf[256];
+    va_list arg_ptr;
+
+    // format - vsnprintf always terminates the buffer.
+    va_start(arg_ptr, format);
+    vsnprintf(buf, sizeof(buf), format, arg_ptr);
+    va_end(arg_ptr);
+
+    // console output
+    fprintf(stderr, "%s\n", buf);
+
+    // syslog
+    syslog(LOG_NOTICE, "%s", buf);
+}
+
+char *policy_rule(char *line)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (strncmp(line, "allow ", 6) == 0)
+        line += 6;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if (line[0] == '#' || line[0] == '\0')
+        return NULL;
+
+    return line;
+}
+
+int policy_path_matches(const char *path, unsigned long long dev, unsigned long long ino)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return 0;
+
+    return (unsigned long long)st.st_dev == dev && (unsigned long long)st.st_ino == ino;
+}
+
+//
+// Look for the command in the index of the given configuration file.
+//
+// Returns 0 if it is present, 1 if it is absent, or -1 if there is no
+// usable index - in which case the configuration file must be parsed.
+//
+static int index_check(const char *conf, const char *prg)
+{
+    char filename[160];
+    struct stat conf_st, st;
+    int ret = -1;
+
+    snprintf(filename, sizeof(filename), "%.*s.idx", (int)(strlen(conf) - 5), conf);
+
+    if (stat(conf, &conf_st) != 0)
+        return -1;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct index_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct index_header *hdr = (const struct index_header *)map;
+
+    //
+    // Is this index valid, and built from the current configuration?
+    //
+    if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->conf_size != (uint64_t)conf_st.st_size ||
+        hdr->conf_mtime_sec != conf_st.st_mtim.tv_sec ||
+        hdr->conf_mtime_nsec != conf_st.st_mtim.tv_nsec ||
+        sizeof(*hdr) + ((uint64_t)hdr->count + hdr->patterns) * sizeof(uint32_t) +
+        hdr->trie_len + hdr->strings_len != (uint64_t)st.st_size ||
+        hdr->trie_len % 4 != 0 || (hdr->patterns > 0 && hdr->trie_len == 0) ||
+        (hdr->strings_len > 0 && map[st.st_size - 1] != '\0'))
+    {
+        logger("Ignoring stale index %s", filename);
+        goto out;
+    }
+
+    const uint32_t *offsets = (const uint32_t *)(map + sizeof(*hdr));
+    const char *trie = (const char *)(offsets + hdr->count + hdr->patterns);
+    const char *strings = trie + hdr->trie_len;
+    size_t lo = 0;
+    size_t hi = hdr->count;
+
+    ret = 1;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (offsets[mid] >= hdr->strings_len)
+        {
+            ret = -1;
+            break;
+        }
+
+        int cmp = strcmp(prg, strings + offsets[mid]);
+
+        if (cmp == 0)
+        {
+            ret = 0;
+            break;
+        }
+
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    //
+    // Not listed exactly - so walk the compiled patterns, in place.
+    //
+    if (ret == 1 && hdr->patterns > 0)
+    {
+        switch (matcher_match_image(trie, hdr->trie_len, prg))
+        {
+        case 1:
+            ret = 0;
+            break;
+        case -1:
+            logger("Ignoring corrupt index %s", filename);
+            ret = -1;
+            break;
+        }
+    }
+
+out:
+    munmap((void *)map, st.st_size);
+    return ret;
+}
+
+//
+// Compile the rules in the given configuration file.
+//
+// Returns NULL, having logged why, if that fails.
+//
+static struct matcher *load_rules(const char *filename)
+{
+    FILE* fp = fopen(filename, "r");
+
+    if (! fp)
+    {
+        logger("Failed to open %s: denying execution.", filename);
+        return NULL;
+    }
+
+    struct matcher *m = matcher_new();
+    char buffer[4096];
+
+    if (!m)
+    {
+        logger("Failed to allocate matcher: denying execution.");
+        fclose(fp);
+        return NULL;
+    }
+
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        char *rule = policy_rule(buffer);
+
+        if (rule && matcher_add(m, rule) != 0)
+        {
+            logger("Failed to add rule %s: denying execution.", rule);
+            matcher_free(m);
+            fclose(fp);
+            return NULL;
+        }
+    }
+
+    fclose(fp);
+    matcher_finish(m);
+    return m;
+}
+
+int policy_check(uid_t uid, const char *prg)
+{
+    //
+    // Get the username
+    //
+    struct passwd *pwd = getpwuid(uid);
+
+    if (pwd == NULL)
+    {
+        logger("Failed to convert UID %d to username", uid);
+        return -1;
+    }
+
+    //
+    // Log the UID, username, and command.
+    //
+    logger("UID:%d USER:%s CMD:%s", uid, pwd->pw_name, prg);
+
+    //
+    // Root can execute everything.
+    //
+    if (uid == 0)
+    {
+        logger("root can execute everything");
+        return 0;
+    }
+
+
+    //
+    // We'll read a per-user configuration file to see if the
+    // execution should be permitted.
+    //
+    char filename[128] = {'\0'};
+    snprintf(filename, sizeof(filename) - 1,
+             "/etc/can-exec/%s.conf", pwd->pw_name);
+
+    //
+    // Use the index, if there's an up to date one.
+    //
+    switch (index_check(filename, prg))
+    {
+    case 0:
+        logger("allowing execution of command.");
+        return 0;
+    case 1:
+        logger("Denying execution of command - no match found.");
+        return -1;
+    }
+
+    //
+    // Read each rule, then look for a match.
+    //
+    struct matcher *m = load_rules(filename);
+
+    if (!m)
+        return -1;
+
+    int ret = matcher_match(m, prg) ? 0 : -1;
+
+    matcher_free(m);
+
+    if (ret == 0)
+        logger("allowing execution of command.");
+    else
+        logger("Denying execution of command - no match found.");
+
+    return ret;
+}
+
+
+//
+// A user's compiled rules, held by a policy snapshot.
+//
+// `m` is NULL if the user may execute nothing, and `all` is set for root.
+//
+struct policy_user
+{
+    uid_t uid;
+    int all;
+    struct matcher *m;
+    struct policy_user *next;
+};
+
+#define POLICY_BUCKETS 1024
+
+struct policy
+{
+    pthread_rwlock_t lock;
+    pthread_mutex_t ref_lock;
+    int refs;
+    struct policy_user *buckets[POLICY_BUCKETS];
+};
+
+
+struct policy *policy_new(void)
+{
+    struct policy *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return NULL;
+
+    pthread_rwlock_init(&p->lock, NULL);
+    pthread_mutex_init(&p->ref_lock, NULL);
+    p->refs = 1;
+    return p;
+}
+
+void policy_get(struct policy *p)
+{
+    pthread_mutex_lock(&p->ref_lock);
+    p->refs++;
+    pthread_mutex_unlock(&p->ref_lock);
+}
+
+void policy_put(struct policy *p)
+{
+    pthread_mutex_lock(&p->ref_lock);
+    int refs = --p->refs;
+    pthread_mutex_unlock(&p->ref_lock);
+
+    if (refs > 0)
+        return;
+
+    for (size_t i = 0; i < POLICY_BUCKETS; i++)
+    {
+        struct policy_user *u = p->buckets[i];
+
+        while (u)
+        {
+            struct policy_user *next = u->next;
+
+            matcher_free(u->m);
+            free(u);
+            u = next;
+        }
+    }
+
+    pthread_rwlock_destroy(&p->lock);
+    pthread_mutex_destroy(&p->ref_lock);
+    free(p);
+}
+
+static struct policy_user *policy_find(struct policy *p, uid_t uid)
+{
+    struct policy_user *u = p->buckets[uid % POLICY_BUCKETS];
+
+    while (u && u->uid != uid)
+        u = u->next;
+
+    return u;
+}
+
+//
+// Compile the rules of the given user.
+//
+static struct policy_user *policy_load_user(uid_t uid)
+{
+    struct policy_user *u = calloc(1, sizeof(*u));
+    struct passwd pwd, *result = NULL;
+    char buf[1024];
+
+    if (!u)
+        return NULL;
+
+    u->uid = uid;
+
+    if (getpwuid_r(uid, &pwd, buf, sizeof(buf), &result) != 0 || result == NULL)
+    {
+        logger("Failed to convert UID %d to username", uid);
+        return u;
+    }
+
+    if (uid == 0)
+    {
+        u->all = 1;
+        return u;
+    }
+
+    char filename[128];
+    snprintf(filename, sizeof(filename), "/etc/can-exec/%s.conf", pwd.pw_name);
+
+    u->m = load_rules(filename);
+    return u;
+}
+
+int policy_check_with(struct policy *p, uid_t uid, const char *prg)
+{
+    struct policy_user *u;
+
+    pthread_rwlock_rdlock(&p->lock);
+    u = policy_find(p, uid);
+    pthread_rwlock_unlock(&p->lock);
+
+    if (!u)
+    {
+        //
+        // Compile the rules without holding the lock, then add them
+        // unless another thread beat us to it.
+        //
+        struct policy_user *loaded = policy_load_user(uid);
+
+        if (!loaded)
+            return -1;
+
+        pthread_rwlock_wrlock(&p->lock);
+        u = policy_find(p, uid);
+
+        if (!u)
+        {
+            loaded->next = p->buckets[uid % POLICY_BUCKETS];
+            p->buckets[uid % POLICY_BUCKETS] = loaded;
+            u = loaded;
+            loaded = NULL;
+        }
+
+        pthread_rwlock_unlock(&p->lock);
+
+        if (loaded)
+        {
+            matcher_free(loaded->m);
+            free(loaded);
+        }
+    }
+
+    if (u->all || (u->m && matcher_match(u->m, prg)))
+        return 0;
+
+    logger("Denying execution of %s by UID %d - no match found.", prg, uid);
+    return -1;
+}
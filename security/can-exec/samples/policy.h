@@ -0,0 +1,64 @@
+/*
+ * Policy decisions for the `can_exec` LSM, shared by the one-shot helper
+ * and the long-running daemon.
+ *
+ * Steve
+ * --
+ */
+
+#ifndef _POLICY_H
+#define _POLICY_H
+
+#include <sys/types.h>
+
+//
+// Log a message to STDERR for testing, and to syslog for production use.
+//
+void logger(const char *format, ...);
+
+//
+// Parse a line of a configuration file, in place.
+//
+// Lines are either a path, or pattern, or the same prefixed by "allow ".
+// Returns the rule, or NULL for blank lines and comments.
+//
+char *policy_rule(char *line);
+
+//
+// Does the given path still lead to the file with the given device and
+// inode numbers?  The kernel asks us to check this when the path it sent
+// was only what the executing task saw, in its own mount namespace.
+//
+// Returns 1 if so, 0 otherwise.
+//
+int policy_path_matches(const char *path, unsigned long long dev, unsigned long long ino);
+
+//
+// Should the given user be allowed to execute the given program?
+//
+// Returns 0 if so, -1 otherwise.
+//
+int policy_check(uid_t uid, const char *prg);
+
+//
+// A snapshot of the policy, for long-running processes.
+//
+// Each user's rules are compiled the first time they're needed, and kept
+// until the snapshot is released - so to pick up changes a new snapshot
+// must be created.  Snapshots may be shared between threads, and are
+// reference-counted; policy_new() returns one holding a single reference.
+//
+struct policy;
+
+struct policy *policy_new(void);
+void policy_get(struct policy *p);
+void policy_put(struct policy *p);
+
+//
+// As policy_check(), but using the given snapshot.
+//
+// Only denials are logged.
+//
+int policy_check_with(struct policy *p, uid_t uid, const char *prg);
+
+#endif
@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * exec_policy.c
+ *
+ * The execution pipeline described in exec_policy.h.
+ *
+ * This is registered as an LSM of its own, which owns the single exec hook,
+ * the shared inode blob, and the hooks which invalidate it.  It takes the
+ * default order, so must be listed in `lsm=` (or CONFIG_LSM) along with the
+ * modules which add stages to it; its place in that list doesn't matter,
+ * as adding a stage needs nothing of ours to have been initialized.
+ *
+ * Without it no stage is ever run, and the verdict-cache is unavailable, so
+ * a lookup always misses - the hashcheck mmap hooks still work, but hash
+ * every file they check.
+ */
+
+#include <linux/lsm_hooks.h>
+#include <linux/security.h>
+#include <linux/xattr.h>
+#include <linux/iversion.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "exec_policy.h"
+
+//
+// The verdict-cache which lives in the inode security blob.
+//
+// Each stage has a slot, which is valid while its bit is set in `valid`,
+// and the inode's i_version and ctime still match those recorded.
+//
+// `gen` is bumped every time the cache is invalidated, so that a verdict
+// which was being calculated while the file changed is never stored.
+//
+struct exec_policy_inode
+{
+    spinlock_t lock;
+    unsigned int gen;
+    unsigned long valid;
+    u64 version;
+    struct timespec64 ctime;
+    int verdict[EXEC_POLICY_STAGES];
+};
+
+//
+// The labels we know about.  Those which are only tested for presence
+// have no need for their value to be read, only their length.
+//
+struct exec_policy_xattr_desc
+{
+    const char *name;
+    bool presence;
+};
+
+static const struct exec_policy_xattr_desc exec_policy_xattrs[EXEC_POLICY_XATTRS] =
+{
+    [EXEC_POLICY_XATTR_WHITELISTED] = { "security.whitelisted", true },
+    [EXEC_POLICY_XATTR_HASH]        = { "security.hash", false },
+};
+
+static struct exec_policy_stage *exec_policy_stages[EXEC_POLICY_STAGES] __ro_after_init;
+static int exec_policy_nr_stages __ro_after_init;
+static bool exec_policy_enabled __ro_after_init;
+
+static struct lsm_blob_sizes exec_policy_blob_sizes __lsm_ro_after_init =
+{
+    .lbs_inode = sizeof(struct exec_policy_inode),
+};
+
+
+static inline struct exec_policy_inode *exec_policy_inode(const struct inode *inode)
+{
+    return inode->i_security + exec_policy_blob_sizes.lbs_inode;
+}
+
+//
+// Add a stage to the pipeline.
+//
+// This is called by each module as it is initialized, so there is no need
+// for any locking.
+//
+void __init exec_policy_add_stage(struct exec_policy_stage *stage)
+{
+    if (WARN_ON(stage->id >= EXEC_POLICY_STAGES || exec_policy_stages[stage->id]))
+        return;
+
+    exec_policy_stages[stage->id] = stage;
+    exec_policy_nr_stages++;
+}
+
+//
+// Prepare to check the given file, on behalf of the current task.
+//
+// Nothing is read until a stage asks for it.
+//
+void exec_policy_ctx_init(struct exec_policy_ctx *ctx, struct file *file,
+                          struct linux_binprm *bprm)
+{
+    ctx->bprm = bprm;
+    ctx->file = file;
+    ctx->dentry = file->f_path.dentry;
+    ctx->inode = d_backing_inode(ctx->dentry);
+    ctx->uid = current_uid();
+    ctx->fetched = 0;
+}
+
+//
+// Free anything read on behalf of the stages.
+//
+void exec_policy_ctx_release(struct exec_policy_ctx *ctx)
+{
+    unsigned int id;
+
+    for_each_set_bit(id, &ctx->fetched, EXEC_POLICY_XATTRS)
+        kfree(ctx->xattr[id].heap);
+}
+
+//
+// Read the given label, with a single call.
+//
+// Of a label which is only tested for presence we only ask the length, so
+// that an empty label may still be told apart.  Any other is read into the
+// context, unless it is too large, when we read it again into a page from
+// the heap - values up to a page have always been accepted.
+//
+// Like the modules always have, we bypass the permission checks of other
+// LSMs, as this is done on behalf of the kernel rather than the task.
+//
+static void exec_policy_fetch(struct exec_policy_ctx *ctx, enum exec_policy_xattr_id id)
+{
+    const struct exec_policy_xattr_desc *desc = &exec_policy_xattrs[id];
+    struct exec_policy_xattr *xattr = &ctx->xattr[id];
+
+    xattr->heap = NULL;
+
+    if (desc->presence)
+        xattr->size = __vfs_getxattr(ctx->dentry, ctx->inode, desc->name,
+                                     NULL, 0);
+    else
+        xattr->size = __vfs_getxattr(ctx->dentry, ctx->inode, desc->name,
+                                     xattr->value, sizeof(xattr->value));
+
+    if (xattr->size == -ERANGE)
+    {
+        xattr->heap = kmalloc(PAGE_SIZE, GFP_KERNEL);
+
+        if (xattr->heap)
+            xattr->size = __vfs_getxattr(ctx->dentry, ctx->inode, desc->name,
+                                         xattr->heap, PAGE_SIZE - 1);
+        else
+            xattr->size = -ENOMEM;
+    }
+
+    ctx->fetched |= BIT(id);
+}
+
+//
+// Return the size of the given label, or a negative error if it couldn't
+// be read, storing its value in `value` if that's non-NULL.
+//
+// Each label is read at most once per check, when a stage first asks for
+// it, so a stage which is never reached costs nothing.  A stage which finds
+// a label missing is expected to cache that, like any other verdict.
+//
+int exec_policy_getxattr(struct exec_policy_ctx *ctx,
+                         enum exec_policy_xattr_id id, const u8 **value)
+{
+    if (!(ctx->fetched & BIT(id)))
+        exec_policy_fetch(ctx, id);
+
+    if (value)
+        *value = ctx->xattr[id].heap ? ctx->xattr[id].heap : ctx->xattr[id].value;
+
+    return ctx->xattr[id].size;
+}
+
+//
+// Look for the verdict a stage cached for the given inode.
+//
+// On a miss the current state of the inode is recorded in `stamp`, which
+// should later be handed to exec_policy_cache_store().
+//
+bool exec_policy_cache_lookup(struct inode *inode, enum exec_policy_stage_id id,
+                              struct exec_policy_stamp *stamp, int *verdict)
+{
+    struct exec_policy_inode *ei;
+    bool hit;
+
+    stamp->version = inode_query_iversion(inode);
+    stamp->ctime = inode->i_ctime;
+
+    // Our blob only exists if we were enabled.
+    if (!exec_policy_enabled)
+        return false;
+
+    ei = exec_policy_inode(inode);
+
+    spin_lock(&ei->lock);
+    hit = (ei->valid & BIT(id)) &&
+          ei->version == stamp->version &&
+          timespec64_equal(&ei->ctime, &stamp->ctime);
+
+    if (hit)
+        *verdict = ei->verdict[id];
+
+    stamp->gen = ei->gen;
+    spin_unlock(&ei->lock);
+
+    return hit;
+}
+
+//
+// Store a stage's verdict, unless the inode was invalidated since `stamp`
+// was taken.
+//
+// The verdicts of other stages are kept only if they were reached with the
+// inode in the same state.
+//
+void exec_policy_cache_store(struct inode *inode, enum exec_policy_stage_id id,
+                             const struct exec_policy_stamp *stamp, int verdict)
+{
+    struct exec_policy_inode *ei;
+
+    if (!exec_policy_enabled)
+        return;
+
+    ei = exec_policy_inode(inode);
+
+    spin_lock(&ei->lock);
+
+    if (ei->gen == stamp->gen)
+    {
+        if (ei->version != stamp->version ||
+            !timespec64_equal(&ei->ctime, &stamp->ctime))
+        {
+            ei->valid = 0;
+            ei->version = stamp->version;
+            ei->ctime = stamp->ctime;
+        }
+
+        ei->valid |= BIT(id);
+        ei->verdict[id] = verdict;
+    }
+
+    spin_unlock(&ei->lock);
+}
+
+//
+// Forget every cached verdict for the given inode.
+//
+static void exec_policy_cache_invalidate(struct inode *inode)
+{
+    struct exec_policy_inode *ei;
+
+    if (!inode || !S_ISREG(inode->i_mode))
+        return;
+
+    ei = exec_policy_inode(inode);
+
+    spin_lock(&ei->lock);
+    ei->valid = 0;
+    ei->gen++;
+    spin_unlock(&ei->lock);
+}
+
+//
+// Is the named attribute one of ours?
+//
+static bool exec_policy_xattr_known(const char *name)
+{
+    unsigned int id;
+
+    for (id = 0; id < EXEC_POLICY_XATTRS; id++)
+    {
+        if (strcmp(name, exec_policy_xattrs[id].name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+
+//
+// Run each stage in turn, stopping at the first which denies.
+//
+static int exec_policy_bprm_check_security(struct linux_binprm *bprm)
+{
+    struct exec_policy_ctx ctx;
+    unsigned int id;
+    int rc = 0;
+
+    if (!exec_policy_nr_stages)
+        return 0;
+
+    exec_policy_ctx_init(&ctx, bprm->file, bprm);
+
+    for (id = 0; id < EXEC_POLICY_STAGES && rc == 0; id++)
+    {
+        struct exec_policy_stage *stage = exec_policy_stages[id];
+        u64 start;
+
+        if (!stage)
+            continue;
+
+        // Root can access everything, unless the stage says otherwise.
+        if (uid_eq(ctx.uid, GLOBAL_ROOT_UID) && !(stage->flags & EXEC_POLICY_ROOT))
+            continue;
+
+        start = lsm_stats_start();
+        rc = lsm_stats_end(stage->stats, start, stage->check(&ctx));
+    }
+
+    exec_policy_ctx_release(&ctx);
+    return rc;
+}
+
+//
+// Setup the verdict-cache for a new inode.
+//
+static int exec_policy_inode_alloc_security(struct inode *inode)
+{
+    spin_lock_init(&exec_policy_inode(inode)->lock);
+    return 0;
+}
+
+//
+// A file opened for writing might be changed, so forget its verdicts.
+//
+static int exec_policy_file_open(struct file *file)
+{
+    if (file->f_mode & FMODE_WRITE)
+        exec_policy_cache_invalidate(file_inode(file));
+
+    return 0;
+}
+
+//
+// A truncated file is a changed file.
+//
+static int exec_policy_path_truncate(const struct path *path)
+{
+    exec_policy_cache_invalidate(d_backing_inode(path->dentry));
+    return 0;
+}
+
+//
+// Changing one of the labels invalidates any cached verdict.
+//
+// We invalidate both before and after the update, so that a check
+// which raced with the change cannot leave the old verdict cached.
+//
+static int exec_policy_inode_setxattr(struct dentry *dentry, const char *name,
+                                      const void *value, size_t size, int flags)
+{
+    if (exec_policy_xattr_known(name))
+        exec_policy_cache_invalidate(d_backing_inode(dentry));
+
+    return 0;
+}
+
+static void exec_policy_inode_post_setxattr(struct dentry *dentry, const char *name,
+                                            const void *value, size_t size, int flags)
+{
+    if (exec_policy_xattr_known(name))
+        exec_policy_cache_invalidate(d_backing_inode(dentry));
+}
+
+static int exec_policy_inode_removexattr(struct dentry *dentry, const char *name)
+{
+    if (exec_policy_xattr_known(name))
+        exec_policy_cache_invalidate(d_backing_inode(dentry));
+
+    return 0;
+}
+
+//
+// The hooks we wish to be installed.
+//
+static struct security_hook_list exec_policy_hooks[] __lsm_ro_after_init =
+{
+    LSM_HOOK_INIT(bprm_check_security, exec_policy_bprm_check_security),
+    LSM_HOOK_INIT(inode_alloc_security, exec_policy_inode_alloc_security),
+    LSM_HOOK_INIT(file_open, exec_policy_file_open),
+    LSM_HOOK_INIT(path_truncate, exec_policy_path_truncate),
+    LSM_HOOK_INIT(inode_setxattr, exec_policy_inode_setxattr),
+    LSM_HOOK_INIT(inode_post_setxattr, exec_policy_inode_post_setxattr),
+    LSM_HOOK_INIT(inode_removexattr, exec_policy_inode_removexattr),
+};
+
+//
+// Show the stages, in the order they're run.
+//
+static int exec_policy_stages_show(struct seq_file *m, void *v)
+{
+    unsigned int id;
+
+    for (id = 0; id < EXEC_POLICY_STAGES; id++)
+    {
+        if (exec_policy_stages[id])
+            seq_printf(m, "%s\n", exec_policy_stages[id]->name);
+    }
+
+    return 0;
+}
+
+static int exec_policy_stages_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, exec_policy_stages_show, NULL);
+}
+
+static const struct file_operations exec_policy_stages_fops =
+{
+    .open    = exec_policy_stages_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+//
+// Install the pipeline.  The stages may be added before or after this.
+//
+static int __init exec_policy_init(void)
+{
+    security_add_hooks(exec_policy_hooks, ARRAY_SIZE(exec_policy_hooks), "exec_policy");
+    exec_policy_enabled = true;
+    printk(KERN_INFO "LSM initialized: exec_policy\n");
+    return 0;
+}
+
+//
+// Create our securityfs entries, once securityfs is available.
+//
+static int __init exec_policy_init_securityfs(void)
+{
+    struct dentry *dir;
+    struct dentry *stages;
+
+    dir = securityfs_create_dir("exec_policy", NULL);
+    if (IS_ERR(dir))
+        return PTR_ERR(dir);
+
+    stages = securityfs_create_file("stages", 0444, dir, NULL,
+                                    &exec_policy_stages_fops);
+    if (IS_ERR(stages))
+    {
+        securityfs_remove(dir);
+        return PTR_ERR(stages);
+    }
+
+    return 0;
+}
+fs_initcall(exec_policy_init_securityfs);
+
+DEFINE_LSM(exec_policy) =
+{
+    .name  = "exec_policy",
+    .init  = exec_policy_init,
+    .blobs = &exec_policy_blob_sizes,
+};
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * exec_policy.h
+ *
+ * The execution pipeline shared by the whitelist, hashcheck and can-exec
+ * modules.
+ *
+ * Rather than each module installing its own bprm_check_security hook, every
+ * enabled module adds a stage to a single pipeline.  One hook runs the stages
+ * in a fixed order, cheapest first, and stops at the first which denies:
+ *
+ *      whitelist -> hashcheck -> can-exec
+ *
+ * The stages share a single inode security blob, in which each caches its
+ * verdict, and the labels they need are read at most once per execution,
+ * when first needed, and handed to each stage via the context.
+ *
+ * Which stages exist depends upon the modules which were built, and which of
+ * those are enabled via `lsm=`, which must also list `exec_policy` itself.  The stages in use may be read from:
+ *
+ *      /sys/kernel/security/exec_policy/stages
+ */
+
+#ifndef _SECURITY_EXEC_POLICY_H
+#define _SECURITY_EXEC_POLICY_H
+
+#include <linux/types.h>
+#include <linux/fs.h>
+#include <linux/cred.h>
+#include <linux/binfmts.h>
+
+#include "lsm_stats.h"
+
+//
+// The stages, in the order in which they're run.
+//
+enum exec_policy_stage_id
+{
+    EXEC_POLICY_STAGE_WHITELIST,
+    EXEC_POLICY_STAGE_HASHCHECK,
+    EXEC_POLICY_STAGE_CAN_EXEC,
+    EXEC_POLICY_STAGES,
+};
+
+//
+// The labels which are read on behalf of the stages.
+//
+enum exec_policy_xattr_id
+{
+    EXEC_POLICY_XATTR_WHITELISTED,
+    EXEC_POLICY_XATTR_HASH,
+    EXEC_POLICY_XATTRS,
+};
+
+//
+// The largest label value we'll read into the context itself.  A larger
+// value, up to a page, is read into `heap` instead, which is freed by
+// exec_policy_ctx_release().
+//
+#define EXEC_POLICY_XATTR_MAX 128
+
+struct exec_policy_xattr
+{
+    int size;
+    u8 *heap;
+    u8 value[EXEC_POLICY_XATTR_MAX];
+};
+
+//
+// A single check of a file, shared by every stage.
+//
+// `bprm` is NULL when the file is being checked for some other reason,
+// such as being mapped executable.
+//
+struct exec_policy_ctx
+{
+    struct linux_binprm *bprm;
+    struct file *file;
+    struct dentry *dentry;
+    struct inode *inode;
+    kuid_t uid;
+    unsigned long fetched;
+    struct exec_policy_xattr xattr[EXEC_POLICY_XATTRS];
+};
+
+//
+// The state of an inode, as captured before a stage starts working out
+// its verdict, which must be handed back when that verdict is stored.
+//
+struct exec_policy_stamp
+{
+    unsigned int gen;
+    u64 version;
+    struct timespec64 ctime;
+};
+
+//
+// A stage also checks executions by root.
+//
+#define EXEC_POLICY_ROOT 0x01
+
+struct exec_policy_stage
+{
+    const char *name;
+    enum exec_policy_stage_id id;
+    unsigned int flags;
+    struct lsm_stats *stats;
+
+    // Return 0 to allow, or a negative error to deny.
+    int (*check)(struct exec_policy_ctx *ctx);
+};
+
+void exec_policy_add_stage(struct exec_policy_stage *stage);
+
+void exec_policy_ctx_init(struct exec_policy_ctx *ctx, struct file *file,
+                          struct linux_binprm *bprm);
+
+void exec_policy_ctx_release(struct exec_policy_ctx *ctx);
+
+int exec_policy_getxattr(struct exec_policy_ctx *ctx,
+                         enum exec_policy_xattr_id id, const u8 **value);
+
+bool exec_policy_cache_lookup(struct inode *inode, enum exec_policy_stage_id id,
+                              struct exec_policy_stamp *stamp, int *verdict);
+
+void exec_policy_cache_store(struct inode *inode, enum exec_policy_stage_id id,
+                             const struct exec_policy_stamp *stamp, int verdict);
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * hashcheck.h - Steve Kemp
+ *
+ * The binary format of the `security.hash` attribute, which is shared
+ * with the stamping tool in samples/.
+ *
+ * A legacy hex-string value can never be mistaken for this, as its
+ * first byte will always be an ASCII hex-digit.
+ *
+ */
+
+#ifndef _HASHCHECK_H
+#define _HASHCHECK_H
+
+#include <linux/types.h>
+
+#define HASHCHECK_XATTR_NAME           "security.hash"
+
+//
+// Version 1 is the header followed by the digest.  Version 2 is the same
+// followed by a `struct hashcheck_xattr_stamp`.
+//
+#define HASHCHECK_XATTR_VERSION        0x01
+#define HASHCHECK_XATTR_VERSION_STAMP  0x02
+
+#define HASHCHECK_ALGO_SHA1            0x01
+
+struct hashcheck_xattr
+{
+    __u8 version;
+    __u8 algo;
+    __u8 digest[];
+} __attribute__((packed));
+
+//
+// The state of the file when it was hashed, so that a tool re-stamping a
+// tree can skip files which haven't changed since.
+//
+// The kernel ignores this: it always compares the digest with the file.
+// All fields are little-endian.
+//
+struct hashcheck_xattr_stamp
+{
+    __u64 ino;
+    __u64 size;
+    __u64 mtime_sec;
+    __u32 mtime_nsec;
+} __attribute__((packed));
+
+#endif
@@ -26,15 +26,113 @@
  * downside.
  *
  *
+ * This runs as the second stage of the shared execution pipeline, described
+ * in exec_policy.h, after whitelist and before can-exec.  The attribute is
+ * read by the pipeline, along with those of the other stages.
+ *
+ *
+ * Verdict Cache
+ * -------------
+ *
+ * Hashing the whole binary on every execution is expensive, so the result
+ * of each check is remembered in the shared inode security blob, along with
+ * the inode's i_version and ctime at the time of the check.  A later
+ * execution of the same, unchanged, binary is satisfied from that cache.
+ *
+ * The cached verdict is discarded whenever the file is opened for writing,
+ * truncated, or has its `security.hash` attribute changed.  The hit/miss
+ * counts may be read from:
+ *
+ *      /sys/kernel/security/hashcheck/cache
+ *
+ * The cache can be populated ahead of time, for example after a reboot or
+ * a package upgrade, by writing a directory to:
+ *
+ *      /sys/kernel/security/hashcheck/prewarm
+ *
+ * Every executable beneath that directory is then checked in the background,
+ * and reading the file shows the progress.
+ *
+ *
+ * Large Files
+ * -----------
+ *
+ * Hashing a binary of a gigabyte or more ties up the executing CPU for the
+ * whole time.  If an asynchronous sha1 driver is available, such as a crypto
+ * accelerator, files of at least the given size, in megabytes, are instead
+ * handed to it, page by page, straight from the page-cache:
+ *
+ *      echo 64 > /proc/sys/kernel/hashcheck/async_threshold
+ *
+ * While the driver hashes one batch of pages we read the next.  The default
+ * of 0 never uses the driver, and the driver chosen is logged at boot.
+ *
+ *
+ * Shared Libraries
+ * ----------------
+ *
+ * Checking only the binary which is executed would let a replaced library
+ * run unchecked, so once this has been enabled:
+ *
+ *      echo 1 > /proc/sys/kernel/hashcheck/mmap
+ *
+ * every executable mapping of a file is checked too, which covers the
+ * dynamic linker, every shared library, and anything mapped by dlopen().
+ * These use the same verdict cache, so each library is hashed once after
+ * it changes, and every other process which maps it only pays for a lookup.
+ *
+ * A mapping made executable by mprotect() can't be hashed, as the caller
+ * holds the memory-map lock.  It is allowed if the same open file was
+ * already allowed to be mapped executable, and hasn't changed since, or if
+ * the cache holds an allow verdict.  Otherwise it is denied, and counted
+ * as `unchecked` in /sys/kernel/security/hashcheck/cache, rather than as a
+ * miss, so it can be told apart from tampering.  Enabling this therefore
+ * breaks a program which maps a file without PROT_EXEC, then mprotect()s
+ * it executable, if nothing has yet checked the file; the dynamic linker
+ * maps libraries executable directly, so isn't affected.
+ *
+ *
+ * Reporting
+ * ---------
+ *
+ * Decisions are reported via the `hashcheck` tracepoints, and denials are
+ * sent to the audit subsystem.  A batch of recent decisions may also be
+ * read from:
+ *
+ *      /sys/kernel/security/hashcheck/decisions
+ *
+ * Decisions are only recorded there while that file is held open.
+ *
+ * Counts of checks, verdicts, errors, cache hits and bytes hashed, and how
+ * long each check took, may be read from:
+ *
+ *      /sys/kernel/security/hashcheck/stats
+ *
+ *
  * Deploying
  * ---------
  *
- * To add the appropriate hashes you could do something like this:
+ * The `security.hash` attribute holds a version byte (0x01), an algorithm
+ * byte (0x01 for SHA1), and then the raw digest.  To add the appropriate
+ * hashes you could do something like this:
  *
  *    for i in /bin/?* /sbin/?*; do
- *          setfattr -n security.hash -v $(sha1sum $i | awk '{print $1}') $i
+ *          setfattr -n security.hash -v 0x0101$(sha1sum $i | awk '{print $1}') $i
  *    done
  *
+ * A label naming any other algorithm is invalid, and denied like any other
+ * malformed label - a verdict which is cached like the rest.
+ *
+ * Rather than doing that by hand use `samples/hashcheck`, which hashes files
+ * in parallel, and writes a version byte of 0x02.  Such a value is followed
+ * by the inode number, size and modification time of the file when it was
+ * hashed, so that re-running the tool only hashes the files which changed.
+ * We ignore those, and check the digest regardless.
+ *
+ * The older format, which is the digest as a hex-string, is still accepted:
+ *
+ *    setfattr -n security.hash -v $(sha1sum $i | awk '{print $1}') $i
+ *
  * Steve
  * --
  *
@@ -48,81 +146,257 @@
 #include <linux/lsm_hooks.h>
 #include <linux/types.h>
 #include <linux/cred.h>
+#include <linux/fs.h>
+#include <linux/security.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/fadvise.h>
+#include <linux/kernel.h>
+#include <linux/namei.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/audit.h>
+#include <linux/ratelimit.h>
+#include <linux/jump_label.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/iversion.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
 #include <crypto/hash.h>
 #include <crypto/sha.h>
 #include <crypto/algapi.h>
 
+#define CREATE_TRACE_POINTS
+#include "hashcheck_trace.h"
+
+#include "../lsm_stats.h"
+#include "../exec_policy.h"
+
+//
+// The binary format of the `security.hash` attribute.
+//
+#include "hashcheck.h"
+
+//
+// The largest attribute value we'll read.
+//
+#define HASHCHECK_XATTR_MAX  (sizeof(struct hashcheck_xattr) + SHA1_DIGEST_SIZE + \
+                              sizeof(struct hashcheck_xattr_stamp))
+
+
+//
+// Statistics, reported via securityfs.
+//
+DEFINE_LSM_STATS(hashcheck_stats);
+
+//
+// Are executable mappings checked too?  Once enabled this can't be undone.
+//
+static int hashcheck_mmap_enabled = 0;
+
+//
+// Executable mappings made by mprotect() which were denied because the file
+// hadn't been checked.
+//
+static DEFINE_PER_CPU(u64, hashcheck_unchecked);
+
+//
+// The state of an inode when an open file was allowed to be mapped
+// executable, kept in the file's security blob, so that mprotect() may
+// later make another mapping of it executable without a cached verdict.
+//
+struct hashcheck_file
+{
+    u64 version;
+    struct timespec64 ctime;
+    bool mapped;
+};
+
+static struct lsm_blob_sizes hashcheck_blob_sizes __lsm_ro_after_init =
+{
+    .lbs_file = sizeof(struct hashcheck_file),
+};
+
+static inline struct hashcheck_file *hashcheck_file(const struct file *file)
+{
+    return file->f_security + hashcheck_blob_sizes.lbs_file;
+}
+
+//
+// Files of at least this many megabytes are hashed by an asynchronous
+// driver, if there is one.  0 means never.
+//
+static int hashcheck_async_threshold = 0;
+static int hashcheck_async_threshold_max = 1024 * 1024;
+
 
 /*
- * Given a file and a blob of memory calculate the SHA1 hash
- * of the file contents, and store it in the memory.
+ * Look for a cached verdict for the given inode.
  *
- * This is a hacky routine, but it does work :)
+ * We store the reason for the verdict, from which the verdict follows.
  *
+ * On a miss the current state of the inode is recorded in `stamp`, which
+ * should later be handed to hashcheck_cache_store().
  */
-int calc_sha1_hash(struct file *file, u8 *digest)
+static bool hashcheck_cache_lookup(struct inode *inode,
+                                   struct exec_policy_stamp *stamp, int *reason)
 {
-    struct crypto_shash *tfm;
+    bool hit = exec_policy_cache_lookup(inode, EXEC_POLICY_STAGE_HASHCHECK, stamp, reason);
+
+    lsm_stats_inc(&hashcheck_stats, hit ? LSM_STAT_CACHE_HITS : LSM_STAT_CACHE_MISSES);
+
+    return hit;
+}
+
+/*
+ * Store a verdict, unless the inode was invalidated since `stamp` was taken.
+ */
+static void hashcheck_cache_store(struct inode *inode,
+                                  const struct exec_policy_stamp *stamp, int reason)
+{
+    exec_policy_cache_store(inode, EXEC_POLICY_STAGE_HASHCHECK, stamp, reason);
+}
+
+
+/*
+ * Scratch space used for hashing a file.
+ *
+ * There is one of these per CPU, allocated once when we start, so that
+ * the execution path doesn't need to allocate anything.  Hashing a file
+ * can sleep, so each one is protected by a mutex rather than by disabling
+ * preemption.
+ *
+ * If there is an asynchronous driver each also holds a request for it,
+ * and the two batches of pages described below.
+ */
+struct hashcheck_scratch
+{
+    struct mutex lock;
     struct shash_desc *desc;
-    loff_t i_size, offset = 0;
     char *rbuf;
-    int rc = 0;
+    struct ahash_request *req;
+    struct hashcheck_ahash_batch *batch;
+};
 
-    // The target we're checking
-    struct dentry *dentry = file->f_path.dentry;
-    struct inode *inode = d_backing_inode(dentry);
+static DEFINE_PER_CPU(struct hashcheck_scratch, hashcheck_scratch);
 
-    // Allocate the hashing-helper.
-    tfm = crypto_alloc_shash("sha1", 0, 0);
+//
+// The hashing-helper, shared by all users.
+//
+static struct crypto_shash *hashcheck_tfm;
 
-    if (IS_ERR(tfm))
-    {
-        int error = PTR_ERR(tfm);
-        printk(KERN_INFO "failed to setup sha1 hasher\n");
-        return error;
-    }
+//
+// The asynchronous hashing-helper, used for large files, if there is one.
+//
+static struct crypto_ahash *hashcheck_ahash_tfm;
+
+
+/*
+ * Claim a scratch area.
+ *
+ * We prefer the one belonging to the CPU we're running upon, but if that
+ * is busy we'll take any other which is free before we wait.
+ */
+static struct hashcheck_scratch *hashcheck_get_scratch(void)
+{
+    struct hashcheck_scratch *scratch;
+    int this_cpu = raw_smp_processor_id();
+    int cpu = this_cpu;
 
-    // Allocate the description.
-    desc = kmalloc(sizeof(*desc) + crypto_shash_descsize(tfm), GFP_KERNEL);
+    if (!hashcheck_tfm)
+        return NULL;
 
-    if (!desc)
+    do
     {
-        printk(KERN_INFO "Failed to kmalloc desc");
-        goto out;
-    }
+        scratch = per_cpu_ptr(&hashcheck_scratch, cpu);
 
-    // Setup the description
-    desc->tfm = tfm;
-    desc->flags = crypto_shash_get_flags(tfm);
+        if (mutex_trylock(&scratch->lock))
+            return scratch;
 
-    // Init the hash
-    rc = crypto_shash_init(desc);
+        cpu = cpumask_next(cpu, cpu_possible_mask);
 
-    if (rc)
-    {
-        printk(KERN_INFO "failed to crypto_shash_init");
-        goto out2;
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_possible_mask);
     }
+    while (cpu != this_cpu);
+
+    scratch = per_cpu_ptr(&hashcheck_scratch, this_cpu);
+    mutex_lock(&scratch->lock);
+    return scratch;
+}
+
+static void hashcheck_put_scratch(struct hashcheck_scratch *scratch)
+{
+    mutex_unlock(&scratch->lock);
+}
+
+
+/*
+ * Feed the contents of the file to the hash, straight from the page-cache.
+ *
+ * We ask for readahead of the whole file up front, then hash each page
+ * in place, which avoids both many small reads and a copy of the data.
+ */
+static int hashcheck_hash_pages(struct file *file, struct shash_desc *desc,
+                                loff_t i_size)
+{
+    struct address_space *mapping = file->f_mapping;
+    pgoff_t index;
+    pgoff_t last = (i_size - 1) >> PAGE_SHIFT;
+    int rc = 0;
 
-    // Allocate a buffer for reading the file contents
-    rbuf = kzalloc(PAGE_SIZE, GFP_KERNEL);
+    vfs_fadvise(file, 0, i_size, POSIX_FADV_WILLNEED);
 
-    if (!rbuf)
+    for (index = 0; index <= last && !rc; index++)
     {
-        printk(KERN_INFO "failed to kzalloc");
-        rc = -ENOMEM;
-        goto out2;
+        struct page *page;
+        size_t len;
+        void *addr;
+
+        page = read_mapping_page(mapping, index, file);
+
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+
+        len = min_t(loff_t, PAGE_SIZE, i_size - ((loff_t)index << PAGE_SHIFT));
+
+        addr = kmap(page);
+        rc = crypto_shash_update(desc, addr, len);
+        kunmap(page);
+        put_page(page);
+
+        cond_resched();
     }
 
-    // Find out how big the file is
-    i_size = i_size_read(inode);
+    return rc;
+}
+
+/*
+ * Feed the contents of the file to the hash, via kernel_read().
+ *
+ * This is used for files which don't live in the page-cache.
+ */
+static int hashcheck_hash_read(struct file *file, struct shash_desc *desc,
+                               char *rbuf, loff_t i_size)
+{
+    loff_t offset = 0;
+    int rc = 0;
 
     // Read it, in page-sized chunks.
     while (offset < i_size)
     {
 
-        int rbuf_len;
-        rbuf_len = kernel_read(file, offset, rbuf, PAGE_SIZE);
+        ssize_t rbuf_len;
+        rbuf_len = kernel_read(file, rbuf, PAGE_SIZE, &offset);
 
         if (rbuf_len < 0)
         {
@@ -133,167 +407,1407 @@ int calc_sha1_hash(struct file *file, u8 *digest)
         if (rbuf_len == 0)
             break;
 
-        offset += rbuf_len;
-
         rc = crypto_shash_update(desc, rbuf, rbuf_len);
 
         if (rc)
             break;
     }
 
-    // Free the buffer we used for holding the file-contents
-    kfree(rbuf);
+    return rc;
+}
+
+/*
+ * Given a file calculate the SHA1 hash of the file contents, and store
+ * it in the given digest.
+ *
+ * The caller must hold the scratch area.
+ */
+static int calc_sha1_hash(struct file *file, struct hashcheck_scratch *scratch,
+                          u8 *digest)
+{
+    struct shash_desc *desc = scratch->desc;
+    loff_t i_size;
+    int rc = 0;
+
+    // The target we're checking
+    struct dentry *dentry = file->f_path.dentry;
+    struct inode *inode = d_backing_inode(dentry);
+    struct address_space *mapping = file->f_mapping;
+
+    // Init the hash
+    rc = crypto_shash_init(desc);
+
+    if (rc)
+        return rc;
+
+    // Find out how big the file is
+    i_size = i_size_read(inode);
+
+    //
+    // Hash directly from the page-cache if we can, otherwise fall back
+    // to reading the file into our scratch buffer.
+    //
+    if (i_size == 0)
+        rc = 0;
+    else if (!IS_DAX(inode) && mapping && mapping->a_ops->readpage)
+        rc = hashcheck_hash_pages(file, desc, i_size);
+    else
+        rc = hashcheck_hash_read(file, desc, scratch->rbuf, i_size);
 
     // Finalise the SHA result.
     if (!rc)
         rc = crypto_shash_final(desc, digest);
 
-out2:
-    kfree(desc);
-out:
-    crypto_free_shash(tfm);
+    if (!rc)
+        lsm_stats_add(&hashcheck_stats, LSM_STAT_BYTES_HASHED, i_size);
+
     return rc;
 }
 
 
 /*
- * Perform a check of a program execution/map.
+ * Asynchronous hashing.
  *
- * Return 0 if it should be allowed, -EPERM on block.
+ * The file is handed to the driver in batches of pages, described by a
+ * scatterlist, taken straight from the page-cache.  There are two batches,
+ * so that we can read the next while the driver hashes the last.
  */
-static int hashcheck_bprm_check_security(struct linux_binprm *bprm)
+#define HASHCHECK_AHASH_PAGES 256
+
+struct hashcheck_ahash_batch
 {
-    u8 *digest;
-    int i;
-    char *hash = NULL;
-    char *buffer = NULL;
-    int rc = 0;
+    struct scatterlist sg[HASHCHECK_AHASH_PAGES];
+    struct page *pages[HASHCHECK_AHASH_PAGES];
+    unsigned int count;
+    unsigned int bytes;
+};
+
+/*
+ * Should the given file be hashed asynchronously?
+ */
+static bool hashcheck_want_async(struct file *file)
+{
+    struct inode *inode = file_inode(file);
+    struct address_space *mapping = file->f_mapping;
+    int threshold = READ_ONCE(hashcheck_async_threshold);
 
-    // The current task & the UID it is running as.
-    const struct task_struct *task = current;
-    kuid_t uid = task->cred->uid;
+    if (!threshold || !hashcheck_ahash_tfm)
+        return false;
 
-    // The target we're checking
-    struct dentry *dentry = bprm->file->f_path.dentry;
-    struct inode *inode = d_backing_inode(dentry);
-    int size = 0;
+    if (IS_DAX(inode) || !mapping || !mapping->a_ops->readpage)
+        return false;
 
-    // Root can access everything.
-    if (uid.val == 0)
-        return 0;
+    return i_size_read(inode) >= ((loff_t)threshold << 20);
+}
 
-    // Allocate some RAM to hold the digest result
-    digest = (u8*)kmalloc(SHA1_DIGEST_SIZE, GFP_KERNEL);
+/*
+ * Fill a batch with the pages following `*index`.
+ *
+ * The batch must be empty.  Its scatterlist was initialized when it was
+ * allocated, and only the end-marker moves between uses.
+ */
+static int hashcheck_ahash_fill(struct file *file, struct hashcheck_ahash_batch *batch,
+                                pgoff_t *index, pgoff_t last, loff_t i_size)
+{
+    batch->bytes = 0;
 
-    if (!digest)
+    while (batch->count < HASHCHECK_AHASH_PAGES && *index <= last)
     {
-        printk(KERN_INFO "failed to allocate storage for digest");
-        return 0;
-    }
+        struct page *page;
+        size_t len;
 
-    //
-    // We're now going to calculate the hash.
-    //
-    memset(digest, 0, SHA1_DIGEST_SIZE);
-    rc = calc_sha1_hash(bprm->file, digest);
+        page = read_mapping_page(file->f_mapping, *index, file);
 
-    //
-    // Now allocate a second piece of RAM to store the human-readable hash.
-    //
-    hash = (char*)kmalloc(PAGE_SIZE, GFP_KERNEL);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
 
-    if (!hash)
-    {
-        printk(KERN_INFO "failed to allocate storage for digest-pretty");
-        rc = -ENOMEM;
-        goto out;
+        len = min_t(loff_t, PAGE_SIZE, i_size - ((loff_t)*index << PAGE_SHIFT));
+
+        sg_set_page(&batch->sg[batch->count], page, len, 0);
+        batch->pages[batch->count++] = page;
+        batch->bytes += len;
+        (*index)++;
     }
 
-    //
-    // Create the human-readable result.
-    //
-    memset(hash, 0, PAGE_SIZE);
+    if (batch->count)
+        sg_mark_end(&batch->sg[batch->count - 1]);
 
-    for (i = 0; i < SHA1_DIGEST_SIZE; i++)
-    {
-        snprintf(hash + (i * 2), 4, "%02x", digest[i]);
-    }
+    return 0;
+}
 
-    //
-    // Allocate the buffer for reading the xattr value
-    //
-    buffer = kzalloc(PAGE_SIZE, GFP_KERNEL);
+static void hashcheck_ahash_release(struct hashcheck_ahash_batch *batch)
+{
+    if (batch->count)
+        sg_unmark_end(&batch->sg[batch->count - 1]);
 
-    if (buffer == NULL)
-    {
-        printk(KERN_INFO "failed to allocate buffer for xattr value\n");
-        goto out2;
-    }
+    while (batch->count)
+        put_page(batch->pages[--batch->count]);
+}
 
-    //
-    // Get the xattr value.
-    //
-    size = __vfs_getxattr(dentry, inode, "security.hash", buffer, PAGE_SIZE - 1);
+/*
+ * Given a file calculate the SHA1 hash of the file contents, using the
+ * asynchronous driver and the given scratch area, and store it in the
+ * given digest.
+ */
+static int calc_sha1_hash_async(struct file *file, struct hashcheck_scratch *scratch,
+                                u8 *digest)
+{
+    struct hashcheck_ahash_batch *batch = scratch->batch;
+    struct ahash_request *req = scratch->req;
+    DECLARE_CRYPTO_WAIT(wait);
+    loff_t i_size = i_size_read(file_inode(file));
+    pgoff_t last = (i_size - 1) >> PAGE_SHIFT;
+    pgoff_t index = 0;
+    int inflight = 0;
+    int cur = 0;
+    int rc;
 
-    //
-    // This is the return-result from this function.
-    //
-    rc = 0;
+    ahash_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+                               crypto_req_done, &wait);
+
+    rc = crypto_wait_req(crypto_ahash_init(req), &wait);
+
+    if (rc)
+        goto out;
+
+    vfs_fadvise(file, 0, i_size, POSIX_FADV_WILLNEED);
 
     //
-    // No hash?  Then the execution is denied.
+    // Read a batch, wait for the driver to finish the previous one, then
+    // hand it this one.
     //
-    if (size < 0)
+    while (index <= last)
     {
-        printk(KERN_INFO "Missing `security.hash` value!\n");
-        rc = -EPERM;
-    }
-    else
-    {
-        //
-        // Using a constant-time comparison see if we got a match.
-        //
-        if (crypto_memneq(buffer, hash, strlen(hash)) == 0)
+        rc = hashcheck_ahash_fill(file, &batch[cur], &index, last, i_size);
+
+        if (inflight)
         {
-            printk(KERN_INFO "Hash of %s matched expected result %s - allowing execution\n", bprm->filename, hash);
-            rc = 0;
+            int err = crypto_wait_req(inflight, &wait);
+
+            inflight = 0;
+            hashcheck_ahash_release(&batch[!cur]);
+
+            if (!rc)
+                rc = err;
         }
-        else
+
+        if (rc)
+            break;
+
+        ahash_request_set_crypt(req, batch[cur].sg, NULL, batch[cur].bytes);
+        inflight = crypto_ahash_update(req);
+
+        if (inflight != -EINPROGRESS && inflight != -EBUSY)
         {
-            printk(KERN_INFO "Hash mismatch for %s - denying execution [%s != %s]\n",  bprm->filename, hash, buffer);
-            rc = -EPERM;
+            rc = inflight;
+            inflight = 0;
+            hashcheck_ahash_release(&batch[cur]);
+
+            if (rc)
+                break;
         }
+
+        cur = !cur;
+        cond_resched();
     }
 
-    kfree(buffer);
+    if (inflight)
+    {
+        int err = crypto_wait_req(inflight, &wait);
 
-out2:
-    kfree(hash);
+        if (!rc)
+            rc = err;
+    }
+
+    if (!rc)
+    {
+        ahash_request_set_crypt(req, NULL, digest, 0);
+        rc = crypto_wait_req(crypto_ahash_final(req), &wait);
+    }
+
+    if (!rc)
+        lsm_stats_add(&hashcheck_stats, LSM_STAT_BYTES_HASHED, i_size);
 
 out:
-    kfree(digest);
+    hashcheck_ahash_release(&batch[0]);
+    hashcheck_ahash_release(&batch[1]);
+    return rc;
+}
+
+
+/*
+ * Extract the expected SHA1 digest from the value of a `security.hash`
+ * attribute.
+ *
+ * A stamped value carries the state of the file when it was hashed, for
+ * the benefit of the tool which wrote it; we always hash the file anyway.
+ *
+ * Return 0 on success, -EINVAL if the value is not understood - including
+ * a value naming any other algorithm.
+ */
+static int hashcheck_parse_xattr(const u8 *value, int size, u8 *expected)
+{
+    const struct hashcheck_xattr *xattr = (const struct hashcheck_xattr *)value;
+
+    if (size > sizeof(*xattr) &&
+        (xattr->version == HASHCHECK_XATTR_VERSION ||
+         xattr->version == HASHCHECK_XATTR_VERSION_STAMP))
+    {
+        int extra = 0;
+
+        if (xattr->version == HASHCHECK_XATTR_VERSION_STAMP)
+            extra = sizeof(struct hashcheck_xattr_stamp);
+
+        if (xattr->algo != HASHCHECK_ALGO_SHA1 ||
+            size != sizeof(*xattr) + SHA1_DIGEST_SIZE + extra)
+            return -EINVAL;
+
+        memcpy(expected, xattr->digest, SHA1_DIGEST_SIZE);
+        return 0;
+    }
+
+    // Legacy hex-string.
+    if (size >= SHA1_DIGEST_SIZE * 2 &&
+        hex2bin(expected, (const char *)value, SHA1_DIGEST_SIZE) == 0)
+        return 0;
 
-    return (rc);
+    return -EINVAL;
 }
 
+
 /*
- * The hooks we wish to be installed.
+ * The verdict which follows from the given reason.
  */
-static struct security_hook_list hashcheck_hooks[] __lsm_ro_after_init =
+static inline int hashcheck_verdict(int reason)
 {
-    LSM_HOOK_INIT(bprm_check_security, hashcheck_bprm_check_security),
-};
+    if (reason == HASHCHECK_REASON_MATCH)
+        return 0;
+
+    return -EPERM;
+}
 
 /*
- * Initialize our module.
+ * Check that the contents of the file being checked match the expected
+ * hash, consulting and updating the verdict cache.
+ *
+ * Nobody may write to the file while we hash it.  An execution already
+ * ensures that, but for any other check we deny writes ourselves, only
+ * once we know the file must be hashed - a cached verdict, or a missing
+ * or invalid label, needs nothing of the contents.  The reason for the
+ * verdict is stored in `reason`, and `cached` records whether it came
+ * from the cache.
+ *
+ * Return 0 if it should be allowed, -EPERM on block, or -ETXTBSY if the
+ * file had to be hashed but is open for writing.
  */
-static int __init hashcheck_init(void)
+static int hashcheck_check_file(struct exec_policy_ctx *ctx, int *reason, bool *cached)
 {
-    /* register ourselves with the security framework */
-    security_add_hooks(hashcheck_hooks, ARRAY_SIZE(hashcheck_hooks), "hashcheck");
-    printk(KERN_INFO "LSM initialized: hashcheck\n");
+    u8 digest[SHA1_DIGEST_SIZE];
+    u8 expected[SHA1_DIGEST_SIZE];
+    const u8 *value;
+    struct hashcheck_scratch *scratch;
+    struct exec_policy_stamp stamp;
+    int rc = 0;
+
+    // The target we're checking
+    struct inode *inode = ctx->inode;
+    int size = 0;
+
+    // Have we already checked this binary, and it hasn't changed since?
+    *cached = hashcheck_cache_lookup(inode, &stamp, reason);
+
+    if (*cached)
+        return hashcheck_verdict(*reason);
+
+    //
+    // Get the xattr value.
+    //
+    // If it is missing, or malformed, there's no need to hash the file
+    // as execution will be denied regardless.
+    //
+    size = exec_policy_getxattr(ctx, EXEC_POLICY_XATTR_HASH, &value);
+
+    if (size < 0)
+    {
+        // Don't cache transient failures.  A value too large to read is
+        // an error, rather than being mistaken for a missing label.
+        if (size == -ENODATA)
+        {
+            *reason = HASHCHECK_REASON_MISSING;
+            hashcheck_cache_store(inode, &stamp, *reason);
+        }
+        else
+        {
+            *reason = HASHCHECK_REASON_ERROR;
+        }
+
+        return -EPERM;
+    }
+
+    if (hashcheck_parse_xattr(value, size, expected) != 0)
+    {
+        *reason = HASHCHECK_REASON_INVALID;
+        hashcheck_cache_store(inode, &stamp, *reason);
+        return -EPERM;
+    }
+
+    //
+    // We're now going to calculate the hash.
+    //
+    if (!ctx->bprm && deny_write_access(ctx->file) != 0)
+    {
+        *reason = HASHCHECK_REASON_ERROR;
+        return -ETXTBSY;
+    }
+
+    //
+    // A large file goes to the asynchronous driver, if there is one, so as
+    // not to tie up this CPU, otherwise we hash it here.  Either way we
+    // use our scratch area.
+    //
+    scratch = hashcheck_get_scratch();
+
+    if (scratch)
+    {
+        if (hashcheck_want_async(ctx->file))
+            rc = calc_sha1_hash_async(ctx->file, scratch, digest);
+        else
+            rc = calc_sha1_hash(ctx->file, scratch, digest);
+
+        hashcheck_put_scratch(scratch);
+    }
+    else
+    {
+        rc = -ENOMEM;
+    }
+
+    if (!ctx->bprm)
+        allow_write_access(ctx->file);
+
+    if (rc)
+    {
+        *reason = HASHCHECK_REASON_ERROR;
+        return -EPERM;
+    }
+
+    //
+    // Using a constant-time comparison see if we got a match.
+    //
+    if (crypto_memneq(expected, digest, SHA1_DIGEST_SIZE) == 0)
+        *reason = HASHCHECK_REASON_MATCH;
+    else
+        *reason = HASHCHECK_REASON_MISMATCH;
+
+    //
+    // Remember the result.
+    //
+    hashcheck_cache_store(inode, &stamp, *reason);
+
+    return hashcheck_verdict(*reason);
+}
+
+
+/*
+ * Reporting decisions.
+ *
+ * Every decision is available via the hashcheck_allow & hashcheck_deny
+ * tracepoints.  While /sys/kernel/security/hashcheck/decisions is held
+ * open they are also recorded into a per-CPU ring, which the reader
+ * drains in batches.  Denials are always sent to the audit subsystem,
+ * subject to rate-limiting.
+ *
+ * Nothing at all is done for an allowed execution unless somebody is
+ * listening.
+ */
+#define HASHCHECK_RING_SIZE 128
+
+struct hashcheck_record
+{
+    u64 time;
+    pid_t pid;
+    uid_t uid;
+    dev_t dev;
+    unsigned long ino;
+    int reason;
+    bool cached;
+    char comm[TASK_COMM_LEN];
+};
+
+//
+// Each ring has a single producer, the CPU which owns it with preemption
+// disabled, and a single consumer, the reader holding hashcheck_ring_mutex.
+//
+struct hashcheck_ring
+{
+    unsigned long head;
+    unsigned long tail;
+    atomic_long_t dropped;
+    struct hashcheck_record records[HASHCHECK_RING_SIZE];
+};
+
+static struct hashcheck_ring __percpu *hashcheck_rings;
+static DEFINE_STATIC_KEY_FALSE(hashcheck_ring_active);
+static DEFINE_MUTEX(hashcheck_ring_mutex);
+
+static DEFINE_RATELIMIT_STATE(hashcheck_audit_rs, 5 * HZ, 10);
+
+static const char * const hashcheck_reason_names[] =
+{
+    [HASHCHECK_REASON_MATCH]    = "match",
+    [HASHCHECK_REASON_MISSING]  = "missing",
+    [HASHCHECK_REASON_INVALID]  = "invalid",
+    [HASHCHECK_REASON_MISMATCH] = "mismatch",
+    [HASHCHECK_REASON_ERROR]    = "error",
+    [HASHCHECK_REASON_UNCHECKED] = "unchecked",
+};
+
+
+/*
+ * Add a decision to this CPU's ring, if there's room.
+ */
+static void hashcheck_ring_record(const struct inode *inode, int reason, bool cached)
+{
+    struct hashcheck_ring *ring;
+    struct hashcheck_record *rec;
+    unsigned long head;
+
+    ring = get_cpu_ptr(hashcheck_rings);
+    head = ring->head;
+
+    if (head - smp_load_acquire(&ring->tail) >= HASHCHECK_RING_SIZE)
+    {
+        atomic_long_inc(&ring->dropped);
+        put_cpu_ptr(hashcheck_rings);
+        return;
+    }
+
+    rec = &ring->records[head & (HASHCHECK_RING_SIZE - 1)];
+    rec->time = ktime_get_real_ns();
+    rec->pid = task_tgid_nr(current);
+    rec->uid = from_kuid(&init_user_ns, current_uid());
+    rec->dev = inode->i_sb->s_dev;
+    rec->ino = inode->i_ino;
+    rec->reason = reason;
+    rec->cached = cached;
+    get_task_comm(rec->comm, current);
+
+    smp_store_release(&ring->head, head + 1);
+    put_cpu_ptr(hashcheck_rings);
+}
+
+/*
+ * Send a denial to the audit subsystem.
+ *
+ * `op` is the operation which was denied: "exec", "mmap" or "mprotect".
+ */
+static void hashcheck_audit_deny(const char *op, const char *filename,
+                                 const struct inode *inode, int reason)
+{
+    struct audit_buffer *ab;
+
+    if (!__ratelimit(&hashcheck_audit_rs))
+        return;
+
+    ab = audit_log_start(audit_context(), GFP_KERNEL, AUDIT_INTEGRITY_DATA);
+
+    if (!ab)
+        return;
+
+    audit_log_format(ab, "lsm=hashcheck op=%s cause=%s", op,
+                     hashcheck_reason_names[reason]);
+    audit_log_task_info(ab);
+    audit_log_format(ab, " path=");
+    audit_log_untrustedstring(ab, filename);
+    audit_log_format(ab, " dev=");
+    audit_log_untrustedstring(ab, inode->i_sb->s_id);
+    audit_log_format(ab, " ino=%lu res=0", inode->i_ino);
+    audit_log_end(ab);
+}
+
+/*
+ * Report a decision.
+ */
+static void hashcheck_report(const char *op, const char *filename,
+                             const struct inode *inode, int reason, bool cached)
+{
+    if (hashcheck_verdict(reason) == 0)
+    {
+        trace_hashcheck_allow(filename, inode, reason, cached);
+    }
+    else
+    {
+        trace_hashcheck_deny(filename, inode, reason, cached);
+        hashcheck_audit_deny(op, filename, inode, reason);
+    }
+
+    if (static_branch_unlikely(&hashcheck_ring_active))
+        hashcheck_ring_record(inode, reason, cached);
+}
+
+/*
+ * Drain the rings, as text, one record per line.
+ *
+ * Only whole records are returned, and a read returns 0 once there are
+ * no more records waiting.
+ */
+static ssize_t hashcheck_decisions_read(struct file *file, char __user *buf,
+                                        size_t count, loff_t *ppos)
+{
+    struct hashcheck_record rec;
+    char line[192];
+    size_t done = 0;
+    int cpu;
+
+    if (mutex_lock_interruptible(&hashcheck_ring_mutex))
+        return -EINTR;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct hashcheck_ring *ring = per_cpu_ptr(hashcheck_rings, cpu);
+        unsigned long head = smp_load_acquire(&ring->head);
+        unsigned long tail = ring->tail;
+        long dropped;
+        int len;
+
+        dropped = atomic_long_xchg(&ring->dropped, 0);
+
+        if (dropped)
+        {
+            len = scnprintf(line, sizeof(line), "cpu=%d dropped=%ld\n", cpu, dropped);
+
+            if (done + len > count || copy_to_user(buf + done, line, len))
+            {
+                atomic_long_add(dropped, &ring->dropped);
+                break;
+            }
+
+            done += len;
+        }
+
+        while (tail != head)
+        {
+            rec = ring->records[tail & (HASHCHECK_RING_SIZE - 1)];
+
+            len = scnprintf(line, sizeof(line),
+                            "time=%llu pid=%d uid=%u comm=%s dev=%u:%u ino=%lu verdict=%s reason=%s cached=%d\n",
+                            rec.time, rec.pid, rec.uid, rec.comm,
+                            MAJOR(rec.dev), MINOR(rec.dev), rec.ino,
+                            hashcheck_verdict(rec.reason) ? "deny" : "allow",
+                            hashcheck_reason_names[rec.reason], rec.cached);
+
+            if (done + len > count || copy_to_user(buf + done, line, len))
+                break;
+
+            done += len;
+            tail++;
+            smp_store_release(&ring->tail, tail);
+        }
+
+        if (tail != head)
+            break;
+    }
+
+    mutex_unlock(&hashcheck_ring_mutex);
+    return done;
+}
+
+static int hashcheck_decisions_open(struct inode *inode, struct file *file)
+{
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    static_branch_inc(&hashcheck_ring_active);
+    return 0;
+}
+
+static int hashcheck_decisions_release(struct inode *inode, struct file *file)
+{
+    static_branch_dec(&hashcheck_ring_active);
+    return 0;
+}
+
+static const struct file_operations hashcheck_decisions_fops =
+{
+    .open    = hashcheck_decisions_open,
+    .read    = hashcheck_decisions_read,
+    .release = hashcheck_decisions_release,
+    .llseek  = noop_llseek,
+};
+
+
+/*
+ * Perform a check of a program execution, as a stage of the pipeline.
+ *
+ * Root is never checked, as the pipeline doesn't call us for it.
+ *
+ * Return 0 if it should be allowed, -EPERM on block.
+ */
+static int hashcheck_check(struct exec_policy_ctx *ctx)
+{
+    int reason;
+    bool cached;
+    int rc;
+
+    rc = hashcheck_check_file(ctx, &reason, &cached);
+    hashcheck_report("exec", ctx->bprm->filename, ctx->inode, reason, cached);
+
+    if (reason == HASHCHECK_REASON_ERROR)
+        lsm_stats_inc(&hashcheck_stats, LSM_STAT_ERRORS);
+
+    return rc;
+}
+
+static struct exec_policy_stage hashcheck_stage __ro_after_init =
+{
+    .name   = "hashcheck",
+    .id     = EXEC_POLICY_STAGE_HASHCHECK,
+    .stats  = &hashcheck_stats,
+    .check  = hashcheck_check,
+};
+
+/*
+ * Check a file which is being mapped executable, such as a shared library.
+ *
+ * Like an execution we insist that nobody is writing to the file while we
+ * hash it, so a file which is open for writing can't be mapped executable
+ * if it needs hashing.  If its verdict is already cached, or it has no
+ * valid label, the contents don't matter and the mapping is decided as
+ * usual.
+ *
+ * Return 0 if it should be allowed, -EPERM or -ETXTBSY on block.
+ */
+static int hashcheck_mmap_file(struct file *file, unsigned long reqprot,
+                               unsigned long prot, unsigned long flags)
+{
+    struct exec_policy_ctx ctx;
+    struct name_snapshot name;
+    u64 start;
+    int reason;
+    bool cached;
+    int rc;
+
+    if (!file || !(prot & PROT_EXEC) || !READ_ONCE(hashcheck_mmap_enabled))
+        return 0;
+
+    // Root can access everything.
+    if (current_uid().val == 0)
+        return 0;
+
+    // Only regular files carry a hash.
+    if (!S_ISREG(file_inode(file)->i_mode))
+        return 0;
+
+    start = lsm_stats_start();
+
+    exec_policy_ctx_init(&ctx, file, NULL);
+    rc = hashcheck_check_file(&ctx, &reason, &cached);
+    exec_policy_ctx_release(&ctx);
+
+    //
+    // Remember that this file may be mapped executable, for mprotect().
+    //
+    if (rc == 0)
+    {
+        struct hashcheck_file *hf = hashcheck_file(file);
+        struct inode *inode = file_inode(file);
+
+        WRITE_ONCE(hf->version, inode_query_iversion(inode));
+        hf->ctime = inode->i_ctime;
+        smp_store_release(&hf->mapped, true);
+    }
+
+    take_dentry_name_snapshot(&name, file->f_path.dentry);
+    hashcheck_report("mmap", name.name.name, file_inode(file), reason, cached);
+    release_dentry_name_snapshot(&name);
+
+    if (reason == HASHCHECK_REASON_ERROR)
+        lsm_stats_inc(&hashcheck_stats, LSM_STAT_ERRORS);
+
+    return lsm_stats_end(&hashcheck_stats, start, rc);
+}
+
+/*
+ * Was this open file allowed to be mapped executable, and is it unchanged?
+ */
+static bool hashcheck_file_mapped(struct file *file, struct inode *inode)
+{
+    struct hashcheck_file *hf = hashcheck_file(file);
+    struct timespec64 ctime = inode->i_ctime;
+
+    if (!smp_load_acquire(&hf->mapped))
+        return false;
+
+    return READ_ONCE(hf->version) == inode_query_iversion(inode) &&
+           timespec64_equal(&hf->ctime, &ctime);
+}
+
+/*
+ * Check an existing mapping of a file which is being made executable.
+ *
+ * This is called with the memory-map lock held, so we can't read the file
+ * here.  Only a file which was already allowed to be mapped executable, or
+ * a verdict which is already cached, will allow it.
+ */
+static int hashcheck_file_mprotect(struct vm_area_struct *vma,
+                                   unsigned long reqprot, unsigned long prot)
+{
+    struct exec_policy_stamp stamp;
+    struct name_snapshot name;
+    struct file *file = vma->vm_file;
+    struct inode *inode;
+    u64 start;
+    int reason;
+    bool cached;
+
+    if (!file || !(prot & PROT_EXEC) || (vma->vm_flags & VM_EXEC) ||
+        !READ_ONCE(hashcheck_mmap_enabled))
+        return 0;
+
+    // Root can access everything.
+    if (current_uid().val == 0)
+        return 0;
+
+    inode = file_inode(file);
+
+    if (!S_ISREG(inode->i_mode))
+        return 0;
+
+    start = lsm_stats_start();
+
+    if (hashcheck_file_mapped(file, inode))
+        return lsm_stats_end(&hashcheck_stats, start, 0);
+
+    //
+    // A miss here isn't a miss of the cache by an exec, which would go on
+    // to hash the file, so it's counted separately.
+    //
+    cached = exec_policy_cache_lookup(inode, EXEC_POLICY_STAGE_HASHCHECK, &stamp, &reason);
+
+    if (cached)
+    {
+        lsm_stats_inc(&hashcheck_stats, LSM_STAT_CACHE_HITS);
+    }
+    else
+    {
+        this_cpu_inc(hashcheck_unchecked);
+        reason = HASHCHECK_REASON_UNCHECKED;
+    }
+
+    take_dentry_name_snapshot(&name, file->f_path.dentry);
+    hashcheck_report("mprotect", name.name.name, inode, reason, cached);
+    release_dentry_name_snapshot(&name);
+
+    return lsm_stats_end(&hashcheck_stats, start, hashcheck_verdict(reason));
+}
+
+/*
+ * The hooks we wish to be installed.
+ */
+static struct security_hook_list hashcheck_hooks[] __lsm_ro_after_init =
+{
+    LSM_HOOK_INIT(mmap_file, hashcheck_mmap_file),
+    LSM_HOOK_INIT(file_mprotect, hashcheck_file_mprotect),
+};
+
+/*
+ * Show the verdict-cache statistics.
+ */
+static int hashcheck_cache_show(struct seq_file *m, void *v)
+{
+    u64 unchecked = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        unchecked += per_cpu(hashcheck_unchecked, cpu);
+
+    seq_printf(m, "hits: %llu\n", lsm_stats_read(&hashcheck_stats, LSM_STAT_CACHE_HITS));
+    seq_printf(m, "misses: %llu\n", lsm_stats_read(&hashcheck_stats, LSM_STAT_CACHE_MISSES));
+    seq_printf(m, "unchecked: %llu\n", unchecked);
+    return 0;
+}
+
+static int hashcheck_cache_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hashcheck_cache_show, NULL);
+}
+
+static const struct file_operations hashcheck_cache_fops =
+{
+    .open    = hashcheck_cache_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+struct ctl_path hashcheck_sysctl_path[] =
+{
+    { .procname = "kernel", },
+    { .procname = "hashcheck", },
+    { }
+};
+
+static struct ctl_table hashcheck_sysctl_table[] =
+{
+    {
+        .procname       = "mmap",
+        .data           = &hashcheck_mmap_enabled,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        /* only handle a transition from default "0" to "1" */
+        .proc_handler   = proc_dointvec_minmax,
+        .extra1         = SYSCTL_ONE,
+        .extra2         = SYSCTL_ONE,
+    },
+    {
+        .procname       = "async_threshold",
+        .data           = &hashcheck_async_threshold,
+        .maxlen         = sizeof(int),
+        .mode           = 0644,
+        .proc_handler   = proc_dointvec_minmax,
+        .extra1         = SYSCTL_ZERO,
+        .extra2         = &hashcheck_async_threshold_max,
+    },
+    { }
+};
+
+/*
+ * Initialize our module.
+ */
+static int __init hashcheck_init(void)
+{
+    BUILD_BUG_ON(HASHCHECK_XATTR_MAX > EXEC_POLICY_XATTR_MAX);
+
+    /* register /proc/sys/kernel/hashcheck/{mmap,async_threshold} */
+    if (!register_sysctl_paths(hashcheck_sysctl_path, hashcheck_sysctl_table))
+        panic("sysctl registration failed.\n");
+
+    /* register ourselves with the security framework */
+    exec_policy_add_stage(&hashcheck_stage);
+    security_add_hooks(hashcheck_hooks, ARRAY_SIZE(hashcheck_hooks), "hashcheck");
+    printk(KERN_INFO "LSM initialized: hashcheck\n");
+    return 0;
+}
+
+/*
+ * Pre-warming the verdict cache.
+ *
+ * Writing a directory to /sys/kernel/security/hashcheck/prewarm causes every
+ * executable file beneath it to be checked in the background, so that the
+ * first real execution of each is satisfied from the cache.  Each directory
+ * is handled by its own work-item, so a tree is processed in parallel.
+ *
+ * We don't follow symlinks, or cross into other mounts.
+ */
+#define HASHCHECK_PREWARM_MAX_DEPTH 64
+
+struct hashcheck_prewarm_dir
+{
+    struct work_struct work;
+    struct path path;
+    unsigned int depth;
+};
+
+struct hashcheck_prewarm_entry
+{
+    struct list_head list;
+    unsigned int type;
+    char name[];
+};
+
+struct hashcheck_prewarm_ctx
+{
+    struct dir_context ctx;
+    struct list_head entries;
+    int count;
+    int error;
+};
+
+static struct workqueue_struct *hashcheck_prewarm_wq;
+
+//
+// Progress of the current, or most recent, pre-warming run.
+//
+static atomic_t hashcheck_prewarm_pending = ATOMIC_INIT(0);
+static atomic_long_t hashcheck_prewarm_dirs = ATOMIC_LONG_INIT(0);
+static atomic_long_t hashcheck_prewarm_allowed = ATOMIC_LONG_INIT(0);
+static atomic_long_t hashcheck_prewarm_denied = ATOMIC_LONG_INIT(0);
+static atomic_long_t hashcheck_prewarm_skipped = ATOMIC_LONG_INIT(0);
+static atomic_long_t hashcheck_prewarm_errors = ATOMIC_LONG_INIT(0);
+
+static int hashcheck_prewarm_queue(const struct path *path, unsigned int depth);
+
+
+/*
+ * Record an entry of the directory we're reading, for later processing.
+ *
+ * This is called with the directory locked, so we don't do anything more.
+ */
+static int hashcheck_prewarm_actor(struct dir_context *ctx, const char *name,
+                                   int len, loff_t offset, u64 ino,
+                                   unsigned int d_type)
+{
+    struct hashcheck_prewarm_ctx *pc = container_of(ctx, struct hashcheck_prewarm_ctx, ctx);
+    struct hashcheck_prewarm_entry *entry;
+
+    if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+        return 0;
+
+    if (d_type != DT_DIR && d_type != DT_REG && d_type != DT_UNKNOWN)
+        return 0;
+
+    entry = kmalloc(sizeof(*entry) + len + 1, GFP_KERNEL);
+
+    if (!entry)
+    {
+        pc->error = -ENOMEM;
+        return -ENOMEM;
+    }
+
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    entry->type = d_type;
+    list_add_tail(&entry->list, &pc->entries);
+    pc->count++;
+
+    return 0;
+}
+
+/*
+ * Check a single file, populating the cache.
+ */
+static void hashcheck_prewarm_file(const struct path *path)
+{
+    struct exec_policy_ctx ctx;
+    struct file *file;
+    int reason;
+    bool cached;
+    int rc;
+
+    file = dentry_open(path, O_RDONLY | O_LARGEFILE, current_cred());
+
+    if (IS_ERR(file))
+    {
+        atomic_long_inc(&hashcheck_prewarm_errors);
+        return;
+    }
+
+    //
+    // Just like execution we insist that nobody is writing to the file
+    // while we hash it, so a file which is open for writing is skipped.
+    //
+    exec_policy_ctx_init(&ctx, file, NULL);
+    rc = hashcheck_check_file(&ctx, &reason, &cached);
+    exec_policy_ctx_release(&ctx);
+    fput(file);
+
+    if (rc == -ETXTBSY)
+        atomic_long_inc(&hashcheck_prewarm_skipped);
+    else if (rc == 0)
+        atomic_long_inc(&hashcheck_prewarm_allowed);
+    else
+        atomic_long_inc(&hashcheck_prewarm_denied);
+}
+
+/*
+ * Process a single entry of a directory.
+ */
+static void hashcheck_prewarm_entry(struct hashcheck_prewarm_dir *dir,
+                                    struct hashcheck_prewarm_entry *entry)
+{
+    struct path child;
+    struct inode *inode;
+
+    if (vfs_path_lookup(dir->path.dentry, dir->path.mnt, entry->name, 0, &child))
+    {
+        atomic_long_inc(&hashcheck_prewarm_errors);
+        return;
+    }
+
+    inode = d_backing_inode(child.dentry);
+
+    if (child.mnt != dir->path.mnt || !inode)
+    {
+        // A mount-point, or a negative dentry from a racing unlink.
+    }
+    else if (S_ISDIR(inode->i_mode))
+    {
+        if (dir->depth < HASHCHECK_PREWARM_MAX_DEPTH)
+        {
+            if (hashcheck_prewarm_queue(&child, dir->depth + 1))
+                atomic_long_inc(&hashcheck_prewarm_errors);
+        }
+    }
+    else if (S_ISREG(inode->i_mode) && (inode->i_mode & S_IXUGO))
+    {
+        hashcheck_prewarm_file(&child);
+    }
+
+    path_put(&child);
+}
+
+/*
+ * Read a directory, queue each sub-directory, and check each executable.
+ */
+static void hashcheck_prewarm_work(struct work_struct *work)
+{
+    struct hashcheck_prewarm_dir *dir = container_of(work, struct hashcheck_prewarm_dir, work);
+    struct hashcheck_prewarm_ctx pc =
+    {
+        .ctx.actor = hashcheck_prewarm_actor,
+        .entries = LIST_HEAD_INIT(pc.entries),
+    };
+    struct hashcheck_prewarm_entry *entry, *tmp;
+    struct file *file;
+    int count;
+
+    file = dentry_open(&dir->path, O_RDONLY | O_DIRECTORY, current_cred());
+
+    if (IS_ERR(file))
+    {
+        atomic_long_inc(&hashcheck_prewarm_errors);
+        goto out;
+    }
+
+    //
+    // Keep reading until there are no more entries.
+    //
+    do
+    {
+        count = pc.count;
+
+        if (iterate_dir(file, &pc.ctx) < 0 || pc.error)
+        {
+            atomic_long_inc(&hashcheck_prewarm_errors);
+            break;
+        }
+    }
+    while (pc.count != count);
+
+    fput(file);
+
+    list_for_each_entry_safe(entry, tmp, &pc.entries, list)
+    {
+        hashcheck_prewarm_entry(dir, entry);
+        list_del(&entry->list);
+        kfree(entry);
+        cond_resched();
+    }
+
+out:
+    path_put(&dir->path);
+    kfree(dir);
+
+    if (atomic_dec_and_test(&hashcheck_prewarm_pending))
+    {
+        printk(KERN_INFO "hashcheck: pre-warming complete, %ld allowed, %ld denied\n",
+               atomic_long_read(&hashcheck_prewarm_allowed),
+               atomic_long_read(&hashcheck_prewarm_denied));
+    }
+}
+
+/*
+ * Queue the given directory to be pre-warmed.
+ */
+static int hashcheck_prewarm_queue(const struct path *path, unsigned int depth)
+{
+    struct hashcheck_prewarm_dir *dir;
+
+    dir = kmalloc(sizeof(*dir), GFP_KERNEL);
+
+    if (!dir)
+        return -ENOMEM;
+
+    INIT_WORK(&dir->work, hashcheck_prewarm_work);
+    dir->path = *path;
+    path_get(&dir->path);
+    dir->depth = depth;
+
+    atomic_inc(&hashcheck_prewarm_pending);
+    atomic_long_inc(&hashcheck_prewarm_dirs);
+    queue_work(hashcheck_prewarm_wq, &dir->work);
+    return 0;
+}
+
+/*
+ * Start pre-warming the directory written to us.
+ */
+static ssize_t hashcheck_prewarm_write(struct file *file, const char __user *buf,
+                                       size_t count, loff_t *ppos)
+{
+    struct path path;
+    char *buffer;
+    int rc;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if (count >= PATH_MAX)
+        return -ENAMETOOLONG;
+
+    buffer = memdup_user_nul(buf, count);
+
+    if (IS_ERR(buffer))
+        return PTR_ERR(buffer);
+
+    rc = kern_path(strim(buffer), LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &path);
+    kfree(buffer);
+
+    if (rc)
+        return rc;
+
+    //
+    // Starting afresh?  Then reset the progress counters.
+    //
+    if (atomic_read(&hashcheck_prewarm_pending) == 0)
+    {
+        atomic_long_set(&hashcheck_prewarm_dirs, 0);
+        atomic_long_set(&hashcheck_prewarm_allowed, 0);
+        atomic_long_set(&hashcheck_prewarm_denied, 0);
+        atomic_long_set(&hashcheck_prewarm_skipped, 0);
+        atomic_long_set(&hashcheck_prewarm_errors, 0);
+    }
+
+    rc = hashcheck_prewarm_queue(&path, 0);
+    path_put(&path);
+
+    return rc ? rc : count;
+}
+
+/*
+ * Show the progress of pre-warming.
+ */
+static int hashcheck_prewarm_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "state: %s\n",
+               atomic_read(&hashcheck_prewarm_pending) ? "running" : "idle");
+    seq_printf(m, "directories: %ld\n", atomic_long_read(&hashcheck_prewarm_dirs));
+    seq_printf(m, "allowed: %ld\n", atomic_long_read(&hashcheck_prewarm_allowed));
+    seq_printf(m, "denied: %ld\n", atomic_long_read(&hashcheck_prewarm_denied));
+    seq_printf(m, "skipped: %ld\n", atomic_long_read(&hashcheck_prewarm_skipped));
+    seq_printf(m, "errors: %ld\n", atomic_long_read(&hashcheck_prewarm_errors));
+    return 0;
+}
+
+static int hashcheck_prewarm_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hashcheck_prewarm_show, NULL);
+}
+
+static const struct file_operations hashcheck_prewarm_fops =
+{
+    .open    = hashcheck_prewarm_open,
+    .read    = seq_read,
+    .write   = hashcheck_prewarm_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+
+/*
+ * Give each scratch area a request for the asynchronous driver, and the
+ * batches to go with it, so that hashing a large file allocates nothing.
+ */
+static int __init hashcheck_init_ahash_scratch(struct crypto_ahash *ahash)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct hashcheck_scratch *scratch = per_cpu_ptr(&hashcheck_scratch, cpu);
+
+        scratch->req = ahash_request_alloc(ahash, GFP_KERNEL);
+        scratch->batch = kcalloc(2, sizeof(*scratch->batch), GFP_KERNEL);
+
+        if (!scratch->req || !scratch->batch)
+            return -ENOMEM;
+
+        sg_init_table(scratch->batch[0].sg, HASHCHECK_AHASH_PAGES);
+        sg_init_table(scratch->batch[1].sg, HASHCHECK_AHASH_PAGES);
+    }
+
+    return 0;
+}
+
+/*
+ * Free whatever was allocated for the asynchronous driver, if that failed.
+ */
+static void __init hashcheck_free_ahash_scratch(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct hashcheck_scratch *scratch = per_cpu_ptr(&hashcheck_scratch, cpu);
+
+        ahash_request_free(scratch->req);
+        kfree(scratch->batch);
+        scratch->req = NULL;
+        scratch->batch = NULL;
+    }
+}
+
+/*
+ * Free whatever scratch areas were allocated, if setting them up failed.
+ */
+static void __init hashcheck_free_scratch(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct hashcheck_scratch *scratch = per_cpu_ptr(&hashcheck_scratch, cpu);
+
+        kfree(scratch->desc);
+        kfree(scratch->rbuf);
+        scratch->desc = NULL;
+        scratch->rbuf = NULL;
+    }
+}
+
+/*
+ * Allocate the hashing-helper, and the per-CPU scratch areas.
+ *
+ * The crypto API isn't available when the LSM itself is initialized,
+ * so this happens later.  No unprivileged process can be executed
+ * before then, but if it fails every check will deny.
+ */
+static int __init hashcheck_init_hash(void)
+{
+    struct crypto_shash *tfm;
+    struct crypto_ahash *ahash;
+    int cpu;
+
+    tfm = crypto_alloc_shash("sha1", 0, 0);
+
+    if (IS_ERR(tfm))
+    {
+        printk(KERN_INFO "failed to setup sha1 hasher\n");
+        return PTR_ERR(tfm);
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        struct hashcheck_scratch *scratch = per_cpu_ptr(&hashcheck_scratch, cpu);
+
+        mutex_init(&scratch->lock);
+
+        scratch->desc = kmalloc(sizeof(*scratch->desc) + crypto_shash_descsize(tfm),
+                                GFP_KERNEL);
+        scratch->rbuf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+
+        if (!scratch->desc || !scratch->rbuf)
+        {
+            printk(KERN_INFO "failed to allocate hashcheck scratch space\n");
+            hashcheck_free_scratch();
+            crypto_free_shash(tfm);
+            return -ENOMEM;
+        }
+
+        scratch->desc->tfm = tfm;
+    }
+
+    hashcheck_tfm = tfm;
+
+    //
+    // Only an asynchronous driver is any use for large files: a software
+    // one would run on this CPU anyway, and shash does that more cheaply.
+    //
+    ahash = crypto_alloc_ahash("sha1", CRYPTO_ALG_ASYNC, CRYPTO_ALG_ASYNC);
+
+    if (IS_ERR(ahash))
+    {
+        printk(KERN_INFO "hashcheck: no asynchronous sha1 driver, large files will be hashed in place\n");
+    }
+    else if (hashcheck_init_ahash_scratch(ahash) != 0)
+    {
+        printk(KERN_INFO "hashcheck: failed to allocate asynchronous hashing space, large files will be hashed in place\n");
+        hashcheck_free_ahash_scratch();
+        crypto_free_ahash(ahash);
+    }
+    else
+    {
+        printk(KERN_INFO "hashcheck: using %s for large files\n",
+               crypto_tfm_alg_driver_name(crypto_ahash_tfm(ahash)));
+        hashcheck_ahash_tfm = ahash;
+    }
+
+    return 0;
+}
+late_initcall(hashcheck_init_hash);
+
+/*
+ * Create our securityfs entries.
+ *
+ * This must wait until securityfs itself is available, which is after
+ * the LSM initialization has happened.
+ */
+static int __init hashcheck_init_securityfs(void)
+{
+    struct dentry *dir;
+    struct dentry *cache;
+    struct dentry *prewarm;
+    struct dentry *decisions;
+    struct dentry *stats;
+
+    hashcheck_prewarm_wq = alloc_workqueue("hashcheck_prewarm", WQ_UNBOUND, 0);
+
+    if (!hashcheck_prewarm_wq)
+        return -ENOMEM;
+
+    hashcheck_rings = alloc_percpu(struct hashcheck_ring);
+
+    if (!hashcheck_rings)
+        return -ENOMEM;
+
+    dir = securityfs_create_dir("hashcheck", NULL);
+
+    if (IS_ERR(dir))
+        return PTR_ERR(dir);
+
+    cache = securityfs_create_file("cache", 0444, dir, NULL,
+                                   &hashcheck_cache_fops);
+
+    if (IS_ERR(cache))
+    {
+        securityfs_remove(dir);
+        return PTR_ERR(cache);
+    }
+
+    prewarm = securityfs_create_file("prewarm", 0600, dir, NULL,
+                                     &hashcheck_prewarm_fops);
+
+    if (IS_ERR(prewarm))
+    {
+        securityfs_remove(cache);
+        securityfs_remove(dir);
+        return PTR_ERR(prewarm);
+    }
+
+    decisions = securityfs_create_file("decisions", 0400, dir, NULL,
+                                       &hashcheck_decisions_fops);
+
+    if (IS_ERR(decisions))
+    {
+        securityfs_remove(prewarm);
+        securityfs_remove(cache);
+        securityfs_remove(dir);
+        return PTR_ERR(decisions);
+    }
+
+    stats = lsm_stats_create(&hashcheck_stats, dir);
+
+    if (IS_ERR(stats))
+    {
+        securityfs_remove(decisions);
+        securityfs_remove(prewarm);
+        securityfs_remove(cache);
+        securityfs_remove(dir);
+        return PTR_ERR(stats);
+    }
+
     return 0;
 }
+fs_initcall(hashcheck_init_securityfs);
 
 
 /*
@@ -302,4 +1816,5 @@ static int __init hashcheck_init(void)
 DEFINE_LSM(hashcheck_init) = {
         .init = hashcheck_init,
         .name = "hashcheck",
+        .blobs = &hashcheck_blob_sizes,
 };
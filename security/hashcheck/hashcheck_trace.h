@@ -0,0 +1,99 @@
+/*
+ * hashcheck_trace.h
+ *
+ * Tracepoints for the decisions made by the hashcheck LSM:
+ *
+ *      /sys/kernel/tracing/events/hashcheck/hashcheck_allow
+ *      /sys/kernel/tracing/events/hashcheck/hashcheck_deny
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hashcheck
+
+#if !defined(_HASHCHECK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HASHCHECK_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+#ifndef _HASHCHECK_REASON_DEFINED
+#define _HASHCHECK_REASON_DEFINED
+
+/*
+ * Why a decision was made.
+ */
+enum hashcheck_reason
+{
+    HASHCHECK_REASON_MATCH,
+    HASHCHECK_REASON_MISSING,
+    HASHCHECK_REASON_INVALID,
+    HASHCHECK_REASON_MISMATCH,
+    HASHCHECK_REASON_ERROR,
+    HASHCHECK_REASON_UNCHECKED,
+};
+
+#endif
+
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_MATCH);
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_MISSING);
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_INVALID);
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_MISMATCH);
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_ERROR);
+TRACE_DEFINE_ENUM(HASHCHECK_REASON_UNCHECKED);
+
+#define show_hashcheck_reason(reason)                   \
+    __print_symbolic(reason,                            \
+        { HASHCHECK_REASON_MATCH,    "match" },         \
+        { HASHCHECK_REASON_MISSING,  "missing" },       \
+        { HASHCHECK_REASON_INVALID,  "invalid" },       \
+        { HASHCHECK_REASON_MISMATCH, "mismatch" },      \
+        { HASHCHECK_REASON_ERROR,    "error" },         \
+        { HASHCHECK_REASON_UNCHECKED, "unchecked" })
+
+DECLARE_EVENT_CLASS(hashcheck_decision,
+
+    TP_PROTO(const char *filename, const struct inode *inode, int reason, bool cached),
+
+    TP_ARGS(filename, inode, reason, cached),
+
+    TP_STRUCT__entry(
+        __string(filename, filename)
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(int, reason)
+        __field(bool, cached)
+    ),
+
+    TP_fast_assign(
+        __assign_str(filename, filename);
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->reason = reason;
+        __entry->cached = cached;
+    ),
+
+    TP_printk("filename=%s dev=%d:%d ino=%lu reason=%s cached=%d",
+              __get_str(filename), MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->ino, show_hashcheck_reason(__entry->reason),
+              __entry->cached)
+);
+
+DEFINE_EVENT(hashcheck_decision, hashcheck_allow,
+    TP_PROTO(const char *filename, const struct inode *inode, int reason, bool cached),
+    TP_ARGS(filename, inode, reason, cached)
+);
+
+DEFINE_EVENT(hashcheck_decision, hashcheck_deny,
+    TP_PROTO(const char *filename, const struct inode *inode, int reason, bool cached),
+    TP_ARGS(filename, inode, reason, cached)
+);
+
+#endif /* _HASHCHECK_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hashcheck_trace
+
+#include <trace/define_trace.h>
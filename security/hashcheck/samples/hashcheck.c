@@ -0,0 +1,481 @@
+/*
+ * Stamp files with the `security.hash` attribute used by the hashcheck LSM.
+ *
+ *   hashcheck [--jobs N] [--all] [--force] [--verbose] /bin /sbin /usr/bin/id [..]
+ *
+ *   hashcheck --verify [--jobs N] [--all] /bin /sbin [..]
+ *
+ * Files named upon the command-line are always handled, and directories are
+ * searched recursively for executables, or for every regular file with
+ * `--all`.  Symlinks are not followed.
+ *
+ * Each file is hashed from an mmap()ed view, by a pool of threads, one per
+ * CPU by default.  The attribute records the inode number, size and
+ * modification time of the file when it was hashed, and a file whose label
+ * still matches those is skipped, so re-stamping a tree after a package
+ * upgrade only hashes the binaries which changed.  `--force` hashes every
+ * file regardless.
+ *
+ * `--verify` hashes every file and reports those whose label is missing or
+ * doesn't match, without changing anything.  The exit status is non-zero
+ * if any file failed.
+ *
+ * Steve
+ * --
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "../hashcheck.h"
+#include "sha1.h"
+
+
+static int all_flag = 0;
+static int force_flag = 0;
+static int verify_flag = 0;
+static int verbose_flag = 0;
+
+static int jobs = 0;
+
+//
+// The files to process, gathered before any hashing starts.
+//
+static char **paths;
+static size_t path_count;
+static size_t path_alloc;
+static atomic_size_t path_next;
+
+//
+// What happened.
+//
+static atomic_long hashed;
+static atomic_long unchanged;
+static atomic_long skipped;
+static atomic_long failed;
+static atomic_long errors;
+
+//
+// The largest label we expect to read.
+//
+#define XATTR_MAX (sizeof(struct hashcheck_xattr) + 64 + sizeof(struct hashcheck_xattr_stamp))
+
+//
+// How many files each thread claims at once.
+//
+#define CHUNK 16
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void report(const char *fmt, const char *path, const char *detail)
+{
+    pthread_mutex_lock(&out_lock);
+    printf(fmt, path, detail);
+    pthread_mutex_unlock(&out_lock);
+}
+
+static void add_path(const char *path)
+{
+    if (path_count == path_alloc)
+    {
+        path_alloc = path_alloc ? path_alloc * 2 : 1024;
+        paths = realloc(paths, path_alloc * sizeof(*paths));
+
+        if (!paths)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    paths[path_count] = strdup(path);
+
+    if (!paths[path_count])
+    {
+        perror("strdup");
+        exit(1);
+    }
+
+    path_count++;
+}
+
+static int collect_entry(const char *path, const struct stat *st,
+                         int typeflag, struct FTW *ftw)
+{
+    (void)ftw;
+
+    if (typeflag == FTW_F && S_ISREG(st->st_mode) &&
+        (all_flag || (st->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))))
+        add_path(path);
+
+    return 0;
+}
+
+/*
+ * Gather the files beneath the given path, or the path itself.
+ */
+static void collect(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        atomic_fetch_add(&errors, 1);
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode))
+    {
+        add_path(path);
+        return;
+    }
+
+    if (nftw(path, collect_entry, 32, FTW_PHYS) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        atomic_fetch_add(&errors, 1);
+    }
+}
+
+
+/*
+ * Hash the contents of the open file.
+ */
+static int hash_file(int fd, const struct stat *st, uint8_t *digest)
+{
+    struct sha1_ctx ctx;
+    void *map;
+
+    sha1_init(&ctx);
+
+    if (st->st_size > 0)
+    {
+        map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED)
+            return -errno;
+
+        madvise(map, st->st_size, MADV_SEQUENTIAL);
+        madvise(map, st->st_size, MADV_WILLNEED);
+        sha1_update(&ctx, map, st->st_size);
+        munmap(map, st->st_size);
+    }
+
+    sha1_final(&ctx, digest);
+    return 0;
+}
+
+static void make_stamp(struct hashcheck_xattr_stamp *stamp, const struct stat *st)
+{
+    stamp->ino = htole64(st->st_ino);
+    stamp->size = htole64(st->st_size);
+    stamp->mtime_sec = htole64(st->st_mtim.tv_sec);
+    stamp->mtime_nsec = htole32(st->st_mtim.tv_nsec);
+}
+
+/*
+ * Work out the digest from an existing label, and whether it carries a
+ * stamp matching the given state.
+ *
+ * Returns the length of the digest, or 0 if the label isn't understood -
+ * including one naming an algorithm other than SHA1.
+ */
+static int parse_label(const uint8_t *value, ssize_t size, const struct stat *st,
+                       uint8_t *digest, int *current)
+{
+    const struct hashcheck_xattr *xattr = (const struct hashcheck_xattr *)value;
+    struct hashcheck_xattr_stamp stamp;
+    int len = SHA1_DIGEST_SIZE;
+
+    *current = 0;
+
+    if (size > (ssize_t)sizeof(*xattr) &&
+        (xattr->version == HASHCHECK_XATTR_VERSION ||
+         xattr->version == HASHCHECK_XATTR_VERSION_STAMP))
+    {
+        size_t extra = 0;
+
+        if (xattr->version == HASHCHECK_XATTR_VERSION_STAMP)
+            extra = sizeof(stamp);
+
+        if (xattr->algo != HASHCHECK_ALGO_SHA1 ||
+            size != (ssize_t)(sizeof(*xattr) + len + extra))
+            return 0;
+
+        memcpy(digest, xattr->digest, len);
+
+        if (extra)
+        {
+            make_stamp(&stamp, st);
+            *current = memcmp(xattr->digest + len, &stamp, sizeof(stamp)) == 0;
+        }
+
+        return len;
+    }
+
+    // Legacy hex-string.
+    if (size >= SHA1_DIGEST_SIZE * 2)
+    {
+        int i;
+
+        for (i = 0; i < SHA1_DIGEST_SIZE; i++)
+        {
+            unsigned int byte;
+
+            if (sscanf((const char *)value + i * 2, "%2x", &byte) != 1)
+                return 0;
+
+            digest[i] = byte;
+        }
+
+        return SHA1_DIGEST_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Stamp, or verify, a single file.
+ */
+static void process(const char *path)
+{
+    uint8_t value[XATTR_MAX];
+    uint8_t label[sizeof(struct hashcheck_xattr) + SHA1_DIGEST_SIZE + sizeof(struct hashcheck_xattr_stamp)];
+    uint8_t expected[SHA1_DIGEST_SIZE];
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    struct hashcheck_xattr *xattr = (struct hashcheck_xattr *)label;
+    struct hashcheck_xattr_stamp stamp;
+    struct stat st, after;
+    ssize_t size;
+    int current = 0;
+    int len = 0;
+    int fd;
+    int rc;
+
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        report("%s: %s\n", path, strerror(errno));
+        atomic_fetch_add(&errors, 1);
+
+        if (fd >= 0)
+            close(fd);
+
+        return;
+    }
+
+    if (!S_ISREG(st.st_mode))
+    {
+        close(fd);
+        atomic_fetch_add(&skipped, 1);
+        return;
+    }
+
+    size = fgetxattr(fd, HASHCHECK_XATTR_NAME, value, sizeof(value));
+
+    if (size > 0)
+        len = parse_label(value, size, &st, expected, &current);
+
+    if (!verify_flag && current && !force_flag)
+    {
+        close(fd);
+        atomic_fetch_add(&unchanged, 1);
+        return;
+    }
+
+    rc = hash_file(fd, &st, digest);
+
+    if (rc == 0 && (fstat(fd, &after) != 0 ||
+                    after.st_size != st.st_size ||
+                    after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+                    after.st_mtim.tv_nsec != st.st_mtim.tv_nsec))
+        rc = -EAGAIN;
+
+    if (rc)
+    {
+        report("%s: %s\n", path, rc == -EAGAIN ? "changed while hashing" : strerror(-rc));
+        atomic_fetch_add(&errors, 1);
+        close(fd);
+        return;
+    }
+
+    atomic_fetch_add(&hashed, 1);
+
+    if (verify_flag)
+    {
+        if (len == 0)
+        {
+            report("%s: %s\n", path, size > 0 ? "INVALID" : "MISSING");
+            atomic_fetch_add(&failed, 1);
+        }
+        else if (memcmp(expected, digest, SHA1_DIGEST_SIZE) != 0)
+        {
+            report("%s: %s\n", path, "MISMATCH");
+            atomic_fetch_add(&failed, 1);
+        }
+        else if (verbose_flag)
+        {
+            report("%s: %s\n", path, "OK");
+        }
+
+        close(fd);
+        return;
+    }
+
+    xattr->version = HASHCHECK_XATTR_VERSION_STAMP;
+    xattr->algo = HASHCHECK_ALGO_SHA1;
+    memcpy(xattr->digest, digest, SHA1_DIGEST_SIZE);
+    make_stamp(&stamp, &st);
+    memcpy(xattr->digest + SHA1_DIGEST_SIZE, &stamp, sizeof(stamp));
+
+    if (fsetxattr(fd, HASHCHECK_XATTR_NAME, label, sizeof(label), 0) != 0)
+    {
+        report("%s: %s\n", path, strerror(errno));
+        atomic_fetch_add(&errors, 1);
+    }
+    else if (verbose_flag)
+    {
+        report("%s: %s\n", path, "stamped");
+    }
+
+    close(fd);
+}
+
+static void *worker(void *arg)
+{
+    size_t start, i;
+
+    (void)arg;
+
+    while ((start = atomic_fetch_add(&path_next, CHUNK)) < path_count)
+    {
+        for (i = start; i < start + CHUNK && i < path_count; i++)
+            process(paths[i]);
+    }
+
+    return NULL;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [--verify] [--jobs N] [--all] [--force] [--verbose] path [..]\n", name);
+    exit(2);
+}
+
+/*
+ * Entry-Point.
+ */
+int main(int argc, char **argv)
+{
+    pthread_t *threads;
+    int c, i;
+
+    while (1)
+    {
+        static struct option long_options[] =
+        {
+            {"all",     no_argument,       &all_flag, 1},
+            {"force",   no_argument,       &force_flag, 1},
+            {"verify",  no_argument,       &verify_flag, 1},
+            {"verbose", no_argument,       &verbose_flag, 1},
+            {"jobs",    required_argument, 0, 'j'},
+            {"help",    no_argument,       0, 'h'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+
+        c = getopt_long(argc, argv, "afvj:h", long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+        case 0:
+            break;
+        case 'a':
+            all_flag = 1;
+            break;
+        case 'f':
+            force_flag = 1;
+            break;
+        case 'v':
+            verbose_flag = 1;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc)
+        usage(argv[0]);
+
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (jobs <= 0)
+        jobs = 1;
+
+    while (optind < argc)
+        collect(argv[optind++]);
+
+    threads = calloc(jobs, sizeof(*threads));
+
+    if (!threads)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; i < jobs; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+
+    if (verify_flag)
+        fprintf(stderr, "%ld verified, %ld failed, %ld skipped, %ld errors\n",
+                atomic_load(&hashed), atomic_load(&failed),
+                atomic_load(&skipped), atomic_load(&errors));
+    else
+        fprintf(stderr, "%ld stamped, %ld unchanged, %ld skipped, %ld errors\n",
+                atomic_load(&hashed), atomic_load(&unchanged),
+                atomic_load(&skipped), atomic_load(&errors));
+
+    for (i = 0; i < (int)path_count; i++)
+        free(paths[i]);
+
+    free(paths);
+
+    return (atomic_load(&failed) || atomic_load(&errors)) ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * A small SHA1 implementation, following FIPS 180-4.
+ */
+
+#include <string.h>
+
+#include "sha1.h"
+
+
+static uint32_t rol(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(struct sha1_ctx *ctx, const uint8_t *p)
+{
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, f, k, t;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+
+    for (i = 16; i < 80; i++)
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+    e = ctx->state[4];
+
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    ctx->length += len;
+
+    if (ctx->used)
+    {
+        size_t n = 64 - ctx->used;
+
+        if (n > len)
+            n = len;
+
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+
+        if (ctx->used < 64)
+            return;
+
+        sha1_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+
+    while (len >= 64)
+    {
+        sha1_block(ctx, p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+void sha1_final(struct sha1_ctx *ctx, uint8_t digest[SHA1_DIGEST_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+
+    if (ctx->used > 56)
+    {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha1_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+
+    for (i = 0; i < 8; i++)
+        ctx->block[56 + i] = bits >> (56 - i * 8);
+
+    sha1_block(ctx, ctx->block);
+
+    for (i = 0; i < 5; i++)
+    {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
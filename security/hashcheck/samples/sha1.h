@@ -0,0 +1,26 @@
+/*
+ * A small SHA1 implementation, so that the tools here need nothing
+ * beyond libc.
+ */
+
+#ifndef _SHA1_H
+#define _SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_SIZE 20
+
+struct sha1_ctx
+{
+    uint32_t state[5];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, uint8_t digest[SHA1_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * lsm_stats.c
+ *
+ * Reporting the statistics described in lsm_stats.h.
+ */
+
+#include <linux/security.h>
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+
+#include "lsm_stats.h"
+
+static const char * const lsm_stat_names[LSM_STAT_MAX] =
+{
+    [LSM_STAT_CALLS]        = "calls",
+    [LSM_STAT_ALLOWS]       = "allows",
+    [LSM_STAT_DENIES]       = "denies",
+    [LSM_STAT_ERRORS]       = "errors",
+    [LSM_STAT_CACHE_HITS]   = "cache_hits",
+    [LSM_STAT_CACHE_MISSES] = "cache_misses",
+    [LSM_STAT_BYTES_HASHED] = "bytes_hashed",
+};
+
+//
+// Sum a counter across every CPU.
+//
+// Counts may be changing as we read them, so the total is only a
+// snapshot, but no CPU is ever stopped to take it.
+//
+u64 lsm_stats_read(struct lsm_stats *stats, enum lsm_stat stat)
+{
+    u64 total = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        total += READ_ONCE(per_cpu_ptr(stats->cpu, cpu)->counter[stat]);
+
+    return total;
+}
+
+static int lsm_stats_show(struct seq_file *m, void *v)
+{
+    struct lsm_stats *stats = m->private;
+    unsigned int i;
+    int cpu;
+
+    for (i = 0; i < LSM_STAT_MAX; i++)
+        seq_printf(m, "%s: %llu\n", lsm_stat_names[i],
+                   lsm_stats_read(stats, i));
+
+    for (i = 0; i < LSM_STATS_BUCKETS; i++)
+    {
+        u64 count = 0;
+
+        for_each_possible_cpu(cpu)
+            count += READ_ONCE(per_cpu_ptr(stats->cpu, cpu)->hist[i]);
+
+        if (count)
+            seq_printf(m, "latency %llu-%lluns: %llu\n",
+                       i ? 1ULL << (i - 1) : 0, 1ULL << i, count);
+    }
+
+    return 0;
+}
+
+static int lsm_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, lsm_stats_show, inode->i_private);
+}
+
+static const struct file_operations lsm_stats_fops =
+{
+    .open    = lsm_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+//
+// Create the `stats` file, for the given statistics, in a module's
+// securityfs directory.
+//
+struct dentry *lsm_stats_create(struct lsm_stats *stats, struct dentry *dir)
+{
+    return securityfs_create_file("stats", 0444, dir, stats, &lsm_stats_fops);
+}
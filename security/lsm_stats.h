@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * lsm_stats.h
+ *
+ * Statistics shared by the can-exec, hashcheck and whitelist modules.
+ *
+ * Each module defines a set of counters, and a log2 histogram of the time
+ * spent in its hook, with DEFINE_LSM_STATS().  Everything is kept per CPU,
+ * so recording never contends, and is summed when read from:
+ *
+ *      /sys/kernel/security/<module>/stats
+ *
+ * Reading takes no locks, so the file may be scraped as often as you like
+ * without slowing down execution.
+ */
+
+#ifndef _SECURITY_LSM_STATS_H
+#define _SECURITY_LSM_STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
+
+enum lsm_stat
+{
+    LSM_STAT_CALLS,
+    LSM_STAT_ALLOWS,
+    LSM_STAT_DENIES,
+    LSM_STAT_ERRORS,
+    LSM_STAT_CACHE_HITS,
+    LSM_STAT_CACHE_MISSES,
+    LSM_STAT_BYTES_HASHED,
+    LSM_STAT_MAX,
+};
+
+//
+// Bucket `n` of the histogram counts hook calls which took [2^(n-1), 2^n)
+// nanoseconds, and bucket zero those which took less than one.
+//
+#define LSM_STATS_BUCKETS 40
+
+struct lsm_stats_cpu
+{
+    u64 counter[LSM_STAT_MAX];
+    u64 hist[LSM_STATS_BUCKETS];
+};
+
+struct lsm_stats
+{
+    struct lsm_stats_cpu __percpu *cpu;
+};
+
+#define DEFINE_LSM_STATS(name)                                  \
+    static DEFINE_PER_CPU(struct lsm_stats_cpu, name##_cpu);    \
+    static struct lsm_stats name = { .cpu = &name##_cpu }
+
+static inline void lsm_stats_add(struct lsm_stats *stats, enum lsm_stat stat, u64 n)
+{
+    this_cpu_add(stats->cpu->counter[stat], n);
+}
+
+static inline void lsm_stats_inc(struct lsm_stats *stats, enum lsm_stat stat)
+{
+    this_cpu_inc(stats->cpu->counter[stat]);
+}
+
+//
+// Call at the start of a hook, handing the result to lsm_stats_end().
+//
+static inline u64 lsm_stats_start(void)
+{
+    return ktime_get_ns();
+}
+
+//
+// Record a call to a hook which returned `rc`, and return `rc`.
+//
+// Errors are counted by the module itself, with lsm_stats_inc(), as only
+// it knows whether a denial was because it couldn't decide.
+//
+static inline int lsm_stats_end(struct lsm_stats *stats, u64 start, int rc)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns) + 1,
+                                     LSM_STATS_BUCKETS - 1) : 0;
+
+    this_cpu_inc(stats->cpu->counter[LSM_STAT_CALLS]);
+    this_cpu_inc(stats->cpu->counter[rc ? LSM_STAT_DENIES : LSM_STAT_ALLOWS]);
+    this_cpu_inc(stats->cpu->hist[bucket]);
+
+    return rc;
+}
+
+u64 lsm_stats_read(struct lsm_stats *stats, enum lsm_stat stat);
+
+struct dentry *lsm_stats_create(struct lsm_stats *stats, struct dentry *dir);
+
+#endif
@@ -8,32 +8,57 @@
  *   whitelist --list [/sbin /usr/sbin]
  *
  * With no arguments it displays whitelisted binaries beneath the current directory,
- * recursively.  If you prefer you can list the directories to search explicitly.
+ * recursively.  If you prefer you can list the directories to search explicitly,
+ * or individual files to check.
+ *
+ * If `--add` or `--del` are given no files then the paths are read from
+ * standard input, one per line, or from the file named by `--manifest`:
+ *
+ *   find /usr/bin -type f | whitelist --add
+ *
+ *   whitelist --del --manifest removed.txt
+ *
+ * Every operation is spread across a pool of threads, one per CPU by
+ * default, or the number given with `--jobs`.  Listing walks each tree
+ * with openat() and getdents64() relative to the directory's descriptor,
+ * and reads each attribute with fgetxattr(), so no path is resolved more
+ * than once.  Directories are shared out between the threads, each of
+ * which works upon its own queue and steals from the others when that is
+ * empty.  The order in which files are listed is not defined.
  *
  * Steve
  * --
  */
 
-/* We want POSIX.1-2008 + XSI, i.e. SuSv4, features */
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ftw.h>
-#include <getopt.h>
-#include <malloc.h>
-#include <dirent.h>
-#include <sys/types.h>
-#include <sys/xattr.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
 
+#define XATTR "security.whitelisted"
 
 static int add_flag = 0;
 static int del_flag = 0;
 static int list_flag = 0;
 
+static int jobs = 0;
+
 
 /*
  * Add the whitelist attribute to the given path.
@@ -42,8 +67,8 @@ void add_whitelist(const char *path)
 {
     char value[2] = "1";
 
-    if (setxattr(path, "security.whitelisted", value, strlen(value), 0) == -1)
-        perror("setxattr");
+    if (setxattr(path, XATTR, value, strlen(value), 0) == -1)
+        fprintf(stderr, "setxattr: %s: %s\n", path, strerror(errno));
 }
 
 /*
@@ -51,43 +76,611 @@ void add_whitelist(const char *path)
  */
 void del_whitelist(const char *path)
 {
-    if (removexattr(path, "security.whitelisted") != 0)
-        perror("removexattr");
+    if (removexattr(path, XATTR) != 0)
+        fprintf(stderr, "removexattr: %s: %s\n", path, strerror(errno));
+}
+
+
+/*
+ * Run `fn` upon `count` threads, handing each its index.
+ */
+static void run_threads(int count, void *(*fn)(void *))
+{
+    pthread_t *threads = calloc(count, sizeof(*threads));
+    intptr_t i;
+
+    if (!threads)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (pthread_create(&threads[i], NULL, fn, (void *)i) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+
+/*
+ * Bulk updates.
+ *
+ * The paths are read up front, then each thread claims a run of them
+ * at a time until there are none left.
+ */
+#define BULK_CHUNK 64
+
+static char **bulk_paths;
+static size_t bulk_count;
+static atomic_size_t bulk_next;
+static void (*bulk_fn)(const char *path);
+
+
+/*
+ * Read paths, one per line, from the given file, or stdin if that is `-`.
+ */
+static void read_paths(const char *manifest)
+{
+    FILE *fp = stdin;
+    char *line = NULL;
+    size_t size = 0;
+    size_t alloc = 0;
+    ssize_t len;
+
+    if (strcmp(manifest, "-") != 0)
+    {
+        fp = fopen(manifest, "r");
+
+        if (!fp)
+        {
+            perror(manifest);
+            exit(1);
+        }
+    }
+
+    while ((len = getline(&line, &size, fp)) != -1)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        if (len == 0)
+            continue;
+
+        if (bulk_count == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 1024;
+            bulk_paths = realloc(bulk_paths, alloc * sizeof(*bulk_paths));
+
+            if (!bulk_paths)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        bulk_paths[bulk_count] = strdup(line);
+
+        if (!bulk_paths[bulk_count])
+        {
+            perror("strdup");
+            exit(1);
+        }
+
+        bulk_count++;
+    }
+
+    free(line);
+
+    if (fp != stdin)
+        fclose(fp);
+}
+
+static void *bulk_worker(void *arg)
+{
+    size_t start, i;
+
+    (void)arg;
+
+    while ((start = atomic_fetch_add(&bulk_next, BULK_CHUNK)) < bulk_count)
+    {
+        for (i = start; i < start + BULK_CHUNK && i < bulk_count; i++)
+            bulk_fn(bulk_paths[i]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Apply `fn` to every path we were given.
+ */
+static void bulk_update(void (*fn)(const char *path))
+{
+    size_t i;
+
+    bulk_fn = fn;
+    atomic_store(&bulk_next, 0);
+
+    run_threads(jobs, bulk_worker);
+
+    for (i = 0; i < bulk_count; i++)
+        free(bulk_paths[i]);
+
+    free(bulk_paths);
+    bulk_paths = NULL;
+    bulk_count = 0;
+}
+
+
+/*
+ * Listing.
+ *
+ * Each directory waiting to be scanned is an item upon the queue of one
+ * of the workers.  It carries a descriptor for the directory, opened
+ * relative to its parent, unless we've already got too many open, in
+ * which case it is opened by path when its turn comes.
+ */
+struct item
+{
+    int fd;
+    char *path;
+};
+
+struct worker
+{
+    pthread_mutex_t lock;
+    struct item *items;
+    size_t head;
+    size_t tail;
+    size_t size;
+
+    char out[65536];
+    size_t out_len;
+    char dents[65536];
+};
+
+static struct worker *workers;
+
+//
+// Items queued or being scanned, and the descriptors they hold.
+//
+static atomic_long pending;
+static atomic_long open_fds;
+static long fd_budget;
+
+//
+// Workers with nothing to do wait here.
+//
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int idle_waiters;
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+
+/*
+ * Output is collected per worker, and written a buffer at a time.
+ */
+static void flush_output(struct worker *w)
+{
+    size_t done = 0;
+
+    pthread_mutex_lock(&out_lock);
+
+    while (done < w->out_len)
+    {
+        ssize_t n = write(STDOUT_FILENO, w->out + done, w->out_len - done);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            perror("write");
+            exit(1);
+        }
+
+        done += n;
+    }
+
+    pthread_mutex_unlock(&out_lock);
+    w->out_len = 0;
+}
+
+static void emit(struct worker *w, const char *path)
+{
+    size_t len = strlen(path);
+
+    if (w->out_len + len + 1 > sizeof(w->out))
+        flush_output(w);
+
+    //
+    // Too long to buffer, so write it out by itself.
+    //
+    if (len + 1 > sizeof(w->out))
+    {
+        pthread_mutex_lock(&out_lock);
+        fprintf(stdout, "%s\n", path);
+        fflush(stdout);
+        pthread_mutex_unlock(&out_lock);
+        return;
+    }
+
+    memcpy(w->out + w->out_len, path, len);
+    w->out[w->out_len + len] = '\n';
+    w->out_len += len + 1;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir);
+    size_t nlen = strlen(name);
+    char *path = malloc(dlen + nlen + 2);
+
+    if (!path)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    memcpy(path, dir, dlen);
+
+    if (dlen == 0 || dir[dlen - 1] != '/')
+        path[dlen++] = '/';
+
+    memcpy(path + dlen, name, nlen + 1);
+    return path;
+}
+
+/*
+ * Queue a directory upon the given worker.
+ */
+static void push(struct worker *w, int fd, char *path)
+{
+    atomic_fetch_add(&pending, 1);
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail - w->head == w->size)
+    {
+        size_t size = w->size ? w->size * 2 : 64;
+        struct item *items = malloc(size * sizeof(*items));
+        size_t i;
+
+        if (!items)
+        {
+            perror("malloc");
+            exit(1);
+        }
+
+        for (i = w->head; i < w->tail; i++)
+            items[i - w->head] = w->items[i % w->size];
+
+        free(w->items);
+        w->items = items;
+        w->tail -= w->head;
+        w->head = 0;
+        w->size = size;
+    }
+
+    w->items[w->tail % w->size].fd = fd;
+    w->items[w->tail % w->size].path = path;
+    w->tail++;
+
+    pthread_mutex_unlock(&w->lock);
+
+    if (atomic_load(&idle_waiters))
+    {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
 }
 
-int print_entry(const char *filepath, const struct stat *info,
-                const int typeflag, struct FTW *pathinfo)
+/*
+ * Take the most recently queued item from our own queue, which keeps us
+ * working depth-first, or the oldest from somebody else's, which is
+ * likely to be the top of a large subtree.
+ */
+static int pop(struct worker *w, struct item *item, int steal)
 {
+    int found = 0;
 
-    /*
-     * We only care about files.
-     */
-    if (typeflag == FTW_F)
+    pthread_mutex_lock(&w->lock);
+
+    if (w->tail != w->head)
     {
-        int length = getxattr(filepath, "security.whitelisted", NULL, 0);
+        if (steal)
+            *item = w->items[w->head++ % w->size];
+        else
+            *item = w->items[--w->tail % w->size];
 
-        if (length > 0)
-            printf("%s\n", filepath);
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static int find_work(int self, struct item *item)
+{
+    int i;
+
+    if (pop(&workers[self], item, 0))
+        return 1;
+
+    for (i = 1; i < jobs; i++)
+    {
+        if (pop(&workers[(self + i) % jobs], item, 1))
+            return 1;
     }
 
     return 0;
 }
+
+static int any_work(void)
+{
+    int i;
+    int found = 0;
+
+    for (i = 0; i < jobs && !found; i++)
+    {
+        pthread_mutex_lock(&workers[i].lock);
+        found = workers[i].tail != workers[i].head;
+        pthread_mutex_unlock(&workers[i].lock);
+    }
+
+    return found;
+}
+
 /*
- * Look at all the files in the given directory, show those that are
- * whitelisted.
+ * Does the given file carry the attribute?
+ *
+ * We read it via a descriptor, relative to the directory, but if we can't
+ * open the file we fall back to its path.
  */
-void list_whitelist(const char *directory)
+static int is_whitelisted(int dirfd, const char *name, const char *dir)
 {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    ssize_t len;
 
-#ifndef USE_FDS
-#define USE_FDS 15
-#endif
+    if (fd >= 0)
+    {
+        len = fgetxattr(fd, XATTR, NULL, 0);
+        close(fd);
+    }
+    else
+    {
+        char *path = join_path(dir, name);
+
+        len = lgetxattr(path, XATTR, NULL, 0);
+        free(path);
+    }
+
+    return len > 0;
+}
+
+/*
+ * Scan a single directory: report whitelisted files, and queue each
+ * subdirectory.  Like nftw(.., FTW_PHYS) we don't follow symlinks.
+ */
+static void scan(int self, struct item *item)
+{
+    struct worker *w = &workers[self];
+    int fd = item->fd;
+    long n;
+
+    if (fd < 0)
+        fd = open(item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else
+        atomic_fetch_sub(&open_fds, 1);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", item->path, strerror(errno));
+        return;
+    }
+
+    while ((n = syscall(SYS_getdents64, fd, w->dents, sizeof(w->dents))) > 0)
+    {
+        long off = 0;
 
+        while (off < n)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(w->dents + off);
+            unsigned char type = d->d_type;
+
+            off += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+
+                if (S_ISDIR(st.st_mode))
+                    type = DT_DIR;
+                else if (S_ISREG(st.st_mode))
+                    type = DT_REG;
+            }
+
+            if (type == DT_REG)
+            {
+                if (is_whitelisted(fd, d->d_name, item->path))
+                {
+                    char *path = join_path(item->path, d->d_name);
+
+                    emit(w, path);
+                    free(path);
+                }
+            }
+            else if (type == DT_DIR)
+            {
+                int child = -1;
 
-    int result = nftw(directory, print_entry, USE_FDS, FTW_PHYS);
+                if (atomic_fetch_add(&open_fds, 1) < fd_budget)
+                    child = openat(fd, d->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
 
-    if (result > 0)
-        perror("nftw");
+                if (child < 0)
+                    atomic_fetch_sub(&open_fds, 1);
+
+                push(w, child, join_path(item->path, d->d_name));
+            }
+        }
+    }
+
+    if (n < 0)
+        fprintf(stderr, "%s: %s\n", item->path, strerror(errno));
+
+    close(fd);
+}
+
+static void *list_worker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    struct item item;
+
+    for (;;)
+    {
+        if (find_work(self, &item))
+        {
+            scan(self, &item);
+            free(item.path);
+
+            if (atomic_fetch_sub(&pending, 1) == 1)
+            {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&idle_waiters, 1);
+
+        if (atomic_load(&pending) == 0)
+        {
+            atomic_fetch_sub(&idle_waiters, 1);
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+
+        if (!any_work())
+            pthread_cond_wait(&idle_cond, &idle_lock);
+
+        atomic_fetch_sub(&idle_waiters, 1);
+        pthread_mutex_unlock(&idle_lock);
+    }
+
+    flush_output(&workers[self]);
+    return NULL;
+}
+
+/*
+ * Look at all the files in the given directories, show those that are
+ * whitelisted.  A file given in place of a directory is checked directly.
+ */
+void list_whitelist(char **directories, int count)
+{
+    struct rlimit rl;
+    int i;
+
+    //
+    // Leave plenty of descriptors for the files we open, and for stdio.
+    //
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        fd_budget = (long)rl.rlim_cur / 2 - jobs - 16;
+    else
+        fd_budget = 1024;
+
+    if (fd_budget < 0)
+        fd_budget = 0;
+
+    workers = calloc(jobs, sizeof(*workers));
+
+    if (!workers)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; i < jobs; i++)
+        pthread_mutex_init(&workers[i].lock, NULL);
+
+    for (i = 0; i < count; i++)
+    {
+        struct stat st;
+        char *path;
+
+        //
+        // Like nftw(.., FTW_PHYS) a symlink is ignored, and anything
+        // other than a directory or regular file too.
+        //
+        if (fstatat(AT_FDCWD, directories[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            fprintf(stderr, "%s: %s\n", directories[i], strerror(errno));
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode))
+        {
+            if (getxattr(directories[i], XATTR, NULL, 0) > 0)
+                printf("%s\n", directories[i]);
+
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode))
+            continue;
+
+        path = strdup(directories[i]);
+
+        if (!path)
+        {
+            perror("strdup");
+            exit(1);
+        }
+
+        push(&workers[i % jobs], -1, path);
+    }
+
+    //
+    // The workers write to the descriptor directly.
+    //
+    fflush(stdout);
+
+    run_threads(jobs, list_worker);
+
+    for (i = 0; i < jobs; i++)
+    {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].items);
+    }
+
+    free(workers);
 }
 
 
@@ -96,6 +689,7 @@ void list_whitelist(const char *directory)
  */
 int main(int argc, char **argv)
 {
+    const char *manifest = "-";
     int c;
 
     while (1)
@@ -105,15 +699,17 @@ int main(int argc, char **argv)
          */
         static struct option long_options[] =
         {
-            {"add",  no_argument, &add_flag, 1},
-            {"del",  no_argument, &del_flag, 1},
-            {"list", no_argument, &list_flag, 1},
+            {"add",      no_argument,       &add_flag, 1},
+            {"del",      no_argument,       &del_flag, 1},
+            {"list",     no_argument,       &list_flag, 1},
+            {"jobs",     required_argument, 0, 'j'},
+            {"manifest", required_argument, 0, 'm'},
             {0, 0, 0, 0}
         };
 
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "", long_options, &option_index);
+        c = getopt_long(argc, argv, "j:m:", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -122,9 +718,16 @@ int main(int argc, char **argv)
         {
         case 0:
 
-            /* If this option set a flag, do nothing else now. */
-            if (long_options[option_index].flag != 0)
-                break;
+            /* This option set a flag, do nothing else now. */
+            break;
+
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+
+        case 'm':
+            manifest = optarg;
+            break;
 
         case '?':
             /* getopt_long already printed an error message. */
@@ -135,22 +738,37 @@ int main(int argc, char **argv)
         }
     }
 
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (jobs <= 0)
+        jobs = 1;
+
     /* No action? Then list. */
     if ((add_flag == 0) && (del_flag == 0) && (list_flag == 0))
         list_flag = 1;
 
-    /* Adding whitelist to some files? */
-    if (add_flag)
+    /* Adding, or removing, the whitelist to some files? */
+    if (add_flag || del_flag)
     {
-        while (optind < argc)
-            add_whitelist(argv[optind++]) ;
-    }
+        /* If we have no files read them from the manifest. */
+        if (optind < argc)
+        {
+            bulk_paths = argv + optind;
+            bulk_count = argc - optind;
+            bulk_fn = add_flag ? add_whitelist : del_whitelist;
+            atomic_store(&bulk_next, 0);
+            run_threads(jobs, bulk_worker);
+            bulk_paths = NULL;
+            bulk_count = 0;
+        }
+        else
+        {
+            read_paths(manifest);
+            bulk_update(add_flag ? add_whitelist : del_whitelist);
+        }
 
-    /* Removing whitelist from some files? */
-    if (del_flag)
-    {
-        while (optind < argc)
-            del_whitelist(argv[optind++]) ;
+        exit(0);
     }
 
     /* Listing files */
@@ -159,12 +777,13 @@ int main(int argc, char **argv)
         /* If we have arguments assume they're directories to list. */
         if (optind < argc)
         {
-            while (optind < argc)
-                list_whitelist(argv[optind++]);
+            list_whitelist(argv + optind, argc - optind);
         }
         else
         {
-            list_whitelist(".");
+            char *here[] = { "." };
+
+            list_whitelist(here, 1);
         }
     }
 
@@ -23,6 +23,49 @@
  * There is a helper tool located in `samples/whitelist` which wraps
  * that for you, in a simple way.
  *
+ * This runs as the first stage of the shared execution pipeline, described
+ * in exec_policy.h, ahead of hashcheck and can-exec.
+ *
+ * Whether the label is present is cached in the inode, so that repeated
+ * execution of the same binary doesn't need to read the attribute.  The
+ * cache is discarded when the label is added or removed, or the file is
+ * changed.
+ *
+ * Trusted Mounts
+ * --------------
+ *
+ * Labelling every file upon a read-only, integrity-protected, image such as
+ * squashfs or dm-verity is pointless.  Instead such filesystems may be listed
+ * on the kernel command-line, either by UUID or, for those which have none,
+ * such as squashfs, by the MAJOR:MINOR of the block device they live upon,
+ * or by both, as UUID@MAJOR:MINOR:
+ *
+ *     whitelist.trusted=0a1b2c3d-..@253:0,253:1
+ *
+ * Beware that a UUID alone proves nothing: it is chosen by whoever creates
+ * the filesystem, so a read-only loop image or USB stick carrying a copy of
+ * a trusted UUID would be trusted too, and its binaries run unlabelled.
+ * Prefer to name the block device, alone or along with the UUID, in which
+ * case both must match.
+ *
+ * or added at runtime:
+ *
+ *     echo 253:0 > /sys/kernel/security/whitelist/trusted_mounts
+ *
+ * Anything executed from such a filesystem is permitted, without looking
+ * for a label, for as long as it remains mounted read-only.  A filesystem
+ * trusted by its device is only trusted whilst that device is read-only
+ * too, as a dm-verity device always is.  Writing `clear` to the file
+ * forgets all the trusted filesystems.
+ *
+ * Statistics
+ * ----------
+ *
+ * Counts of checks, verdicts and cache hits, and how long the checks took,
+ * may be read from:
+ *
+ *     /sys/kernel/security/whitelist/stats
+ *
  * Steve
  * --
  *
@@ -33,52 +76,477 @@
 #include <linux/binfmts.h>
 #include <linux/lsm_hooks.h>
 #include <linux/cred.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/spinlock.h>
+#include <linux/security.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/uuid.h>
+#include <linux/string.h>
+
+#include "../lsm_stats.h"
+#include "../exec_policy.h"
+
 
+/*
+ * Whether the label is present, as cached in the shared inode blob.
+ */
+enum whitelist_state {
+	WHITELIST_UNKNOWN = 0,
+	WHITELIST_PRESENT,
+	WHITELIST_ABSENT,
+};
 
 /*
- * Perform a check of a program execution/map.
+ * Trusted filesystems.
  *
- * Return 0 if it should be allowed, -EPERM on block.
+ * The configured UUIDs, and block devices, are matched against each
+ * filesystem as it is mounted, and the superblocks of those which match are
+ * recorded, so that the check at execution time is only a comparison of
+ * pointers.
+ */
+#define WHITELIST_MAX_TRUSTED 8
+
+struct whitelist_trusted_id {
+	uuid_t uuid;		/* null when trusted by device alone */
+	dev_t dev;		/* 0 when trusted by UUID alone */
+};
+
+static DEFINE_SPINLOCK(whitelist_trusted_lock);
+static struct whitelist_trusted_id whitelist_trusted_id[WHITELIST_MAX_TRUSTED];
+static int whitelist_trusted_ids;
+static struct super_block *whitelist_trusted_sb[WHITELIST_MAX_TRUSTED];
+static bool whitelist_trusted_sb_bdev[WHITELIST_MAX_TRUSTED];
+static int whitelist_trusted_sbs;
+
+DEFINE_LSM_STATS(whitelist_stats);
+
+
+/*
+ * Return the cached state of the label, recording the current state of
+ * the inode in `stamp` for use with whitelist_cache_store().
+ */
+static enum whitelist_state whitelist_cache_lookup(struct inode *inode,
+						   struct exec_policy_stamp *stamp)
+{
+	int state;
+
+	if (!exec_policy_cache_lookup(inode, EXEC_POLICY_STAGE_WHITELIST, stamp, &state))
+		return WHITELIST_UNKNOWN;
+
+	return state;
+}
+
+/*
+ * Store the state of the label, unless it changed since `stamp` was taken.
+ */
+static void whitelist_cache_store(struct inode *inode,
+				  const struct exec_policy_stamp *stamp,
+				  enum whitelist_state state)
+{
+	exec_policy_cache_store(inode, EXEC_POLICY_STAGE_WHITELIST, stamp, state);
+}
+
+/*
+ * Is the given superblock one we trust?
+ */
+static bool whitelist_trusted(const struct super_block *sb)
+{
+	int i;
+
+	if (!READ_ONCE(whitelist_trusted_sbs) || !sb_rdonly(sb))
+		return false;
+
+	for (i = 0; i < WHITELIST_MAX_TRUSTED; i++) {
+		if (READ_ONCE(whitelist_trusted_sb[i]) == sb)
+			return !READ_ONCE(whitelist_trusted_sb_bdev[i]) ||
+				bdev_read_only(sb->s_bdev);
+	}
+
+	return false;
+}
+
+/*
+ * Does the given superblock match a configured UUID and/or block device?
+ * When both are configured both must match.
+ */
+static bool whitelist_trusted_id_match(const struct whitelist_trusted_id *id,
+				       const struct super_block *sb)
+{
+	if (id->dev && (!sb->s_bdev || sb->s_dev != id->dev))
+		return false;
+
+	if (uuid_is_null(&id->uuid))
+		return id->dev != 0;
+
+	return uuid_equal(&sb->s_uuid, &id->uuid);
+}
+
+/*
+ * Record the given superblock as trusted, if it has been configured.
+ *
+ * Called with whitelist_trusted_lock held.
+ */
+static void whitelist_trust_sb(struct super_block *sb)
+{
+	bool bdev;
+	int free = -1;
+	int i;
+
+	for (i = 0; i < whitelist_trusted_ids; i++) {
+		if (whitelist_trusted_id_match(&whitelist_trusted_id[i], sb))
+			break;
+	}
+
+	if (i == whitelist_trusted_ids)
+		return;
+
+	bdev = whitelist_trusted_id[i].dev != 0;
+
+	for (i = 0; i < WHITELIST_MAX_TRUSTED; i++) {
+		if (whitelist_trusted_sb[i] == sb)
+			return;
+		if (!whitelist_trusted_sb[i] && free < 0)
+			free = i;
+	}
+
+	if (free < 0) {
+		printk(KERN_INFO "whitelist LSM: too many trusted mounts, ignoring %s\n", sb->s_id);
+		return;
+	}
+
+	WRITE_ONCE(whitelist_trusted_sb_bdev[free], bdev);
+	WRITE_ONCE(whitelist_trusted_sb[free], sb);
+	WRITE_ONCE(whitelist_trusted_sbs, whitelist_trusted_sbs + 1);
+	printk(KERN_INFO "whitelist LSM: trusting %s\n", sb->s_id);
+}
+
+static void whitelist_trust_existing_sb(struct super_block *sb, void *unused)
+{
+	spin_lock(&whitelist_trusted_lock);
+	whitelist_trust_sb(sb);
+	spin_unlock(&whitelist_trusted_lock);
+}
+
+/*
+ * Parse a block device, given as MAJOR:MINOR.
+ */
+static int whitelist_parse_dev(const char *str, dev_t *dev)
+{
+	unsigned int major, minor;
+	int len = 0;
+
+	if (sscanf(str, "%u:%u%n", &major, &minor, &len) != 2 || str[len])
+		return -EINVAL;
+
+	*dev = MKDEV(major, minor);
+	if (!*dev || MAJOR(*dev) != major || MINOR(*dev) != minor)
+		return -EINVAL;
+
+	return 0;
+}
+
+/*
+ * Parse a trusted filesystem, given as a UUID, MAJOR:MINOR, or both as
+ * UUID@MAJOR:MINOR.
+ */
+static int whitelist_parse_trusted_id(const char *str, struct whitelist_trusted_id *id)
+{
+	memset(id, 0, sizeof(*id));
+
+	if (!strchr(str, '-'))
+		return whitelist_parse_dev(str, &id->dev);
+
+	if (strlen(str) < UUID_STRING_LEN ||
+	    uuid_parse(str, &id->uuid) || uuid_is_null(&id->uuid))
+		return -EINVAL;
+
+	str += UUID_STRING_LEN;
+
+	if (!*str)
+		return 0;
+
+	if (*str != '@')
+		return -EINVAL;
+
+	return whitelist_parse_dev(str + 1, &id->dev);
+}
+
+/*
+ * Add a UUID, block device, or both, to the trusted list.
  */
-static int whitelist_bprm_check_security(struct linux_binprm *bprm)
+static int whitelist_add_trusted(const char *str)
 {
-       // The current task & the UID it is running as.
-       const struct task_struct *task = current;
-       kuid_t uid = task->cred->uid;
+	struct whitelist_trusted_id id;
+	int rc = 0;
+	int i;
+
+	if (whitelist_parse_trusted_id(str, &id))
+		return -EINVAL;
+
+	spin_lock(&whitelist_trusted_lock);
+
+	for (i = 0; i < whitelist_trusted_ids; i++) {
+		if (whitelist_trusted_id[i].dev == id.dev &&
+		    uuid_equal(&whitelist_trusted_id[i].uuid, &id.uuid))
+			goto out;
+	}
+
+	if (whitelist_trusted_ids == WHITELIST_MAX_TRUSTED) {
+		rc = -ENOSPC;
+		goto out;
+	}
+
+	whitelist_trusted_id[whitelist_trusted_ids++] = id;
+out:
+	spin_unlock(&whitelist_trusted_lock);
+	return rc;
+}
 
+/*
+ * Parse `whitelist.trusted=ID[,ID..]` from the command-line.
+ */
+static int __init whitelist_trusted_setup(char *str)
+{
+	char *id;
+
+	while ((id = strsep(&str, ",")) != NULL) {
+		if (*id && whitelist_add_trusted(id))
+			printk(KERN_INFO "whitelist LSM: ignoring trusted mount %s\n", id);
+	}
+
+	return 1;
+}
+__setup("whitelist.trusted=", whitelist_trusted_setup);
+
+
+/*
+ * Perform a check of a program execution, as a stage of the pipeline.
+ *
+ * Root is never checked, as the pipeline doesn't call us for it.
+ *
+ * Return 0 if it should be allowed, -EPERM on block.
+ */
+static int whitelist_check(struct exec_policy_ctx *ctx)
+{
        // The target we're checking
-       struct dentry *dentry = bprm->file->f_path.dentry;
-       struct inode *inode = d_backing_inode(dentry);
+       struct inode *inode = ctx->inode;
 
        // Size of the attribute, if any.
        int size = 0;
 
-       // Root can access everything.
-       if ( uid.val == 0 )
+       struct exec_policy_stamp stamp;
+       enum whitelist_state state;
+
+       // Everything upon a trusted filesystem is permitted.
+       if ( whitelist_trusted(inode->i_sb) )
           return 0;
 
-       // Is there an attribute?  If so allow the access
-       size = __vfs_getxattr(dentry, inode, "security.whitelisted", NULL, 0);
-       if ( size > 0 )
+       // Have we seen this binary before?
+       state = whitelist_cache_lookup(inode, &stamp);
+       lsm_stats_inc(&whitelist_stats, state == WHITELIST_UNKNOWN ?
+                     LSM_STAT_CACHE_MISSES : LSM_STAT_CACHE_HITS);
+
+       if ( state == WHITELIST_PRESENT )
            return 0;
 
+       if ( state == WHITELIST_UNKNOWN ) {
+           // Is there an attribute?  If so allow the access.
+           size = exec_policy_getxattr(ctx, EXEC_POLICY_XATTR_WHITELISTED, NULL);
+
+           // Remember the answer, unless we failed to find it out.  An
+           // empty attribute counts as no attribute.
+           if ( size > 0 )
+               whitelist_cache_store(inode, &stamp, WHITELIST_PRESENT);
+           else if ( size == 0 || size == -ENODATA )
+               whitelist_cache_store(inode, &stamp, WHITELIST_ABSENT);
+
+           if ( size > 0 )
+               return 0;
+
+           if ( size < 0 && size != -ENODATA )
+               lsm_stats_inc(&whitelist_stats, LSM_STAT_ERRORS);
+       } else {
+           size = -ENODATA;
+       }
+
        // Otherwise deny it.
-       printk(KERN_INFO "whitelist LSM check of %s denying access for UID %d [ERRO:%d] \n", bprm->filename, uid.val, size );
+       printk(KERN_INFO "whitelist LSM check of %s denying access for UID %d [ERRO:%d] \n", ctx->bprm->filename, ctx->uid.val, size );
        return -EPERM;
 }
 
+static struct exec_policy_stage whitelist_stage __ro_after_init = {
+	.name	= "whitelist",
+	.id	= EXEC_POLICY_STAGE_WHITELIST,
+	.stats	= &whitelist_stats,
+	.check	= whitelist_check,
+};
+
+/*
+ * Trust a newly-mounted filesystem, if it has been configured.
+ */
+static int whitelist_sb_kern_mount(struct super_block *sb)
+{
+	if (READ_ONCE(whitelist_trusted_ids))
+		whitelist_trust_existing_sb(sb, NULL);
+	return 0;
+}
+
+/*
+ * Forget a filesystem which is going away.
+ */
+static void whitelist_sb_free_security(struct super_block *sb)
+{
+	int i;
+
+	spin_lock(&whitelist_trusted_lock);
+	for (i = 0; i < WHITELIST_MAX_TRUSTED; i++) {
+		if (whitelist_trusted_sb[i] == sb) {
+			WRITE_ONCE(whitelist_trusted_sb[i], NULL);
+			WRITE_ONCE(whitelist_trusted_sbs, whitelist_trusted_sbs - 1);
+		}
+	}
+	spin_unlock(&whitelist_trusted_lock);
+}
+
 /*
  * The hooks we wish to be installed.
  */
 static struct security_hook_list whitelist_hooks[] __lsm_ro_after_init = {
-	LSM_HOOK_INIT(bprm_check_security, whitelist_bprm_check_security),
+	LSM_HOOK_INIT(sb_kern_mount, whitelist_sb_kern_mount),
+	LSM_HOOK_INIT(sb_free_security, whitelist_sb_free_security),
+};
+
+/*
+ * Show the trusted UUIDs, and block devices.
+ */
+static int whitelist_trusted_show(struct seq_file *m, void *v)
+{
+	struct whitelist_trusted_id id[WHITELIST_MAX_TRUSTED];
+	int count;
+	int i;
+
+	spin_lock(&whitelist_trusted_lock);
+	count = whitelist_trusted_ids;
+	memcpy(id, whitelist_trusted_id, sizeof(id));
+	spin_unlock(&whitelist_trusted_lock);
+
+	for (i = 0; i < count; i++) {
+		if (!id[i].dev)
+			seq_printf(m, "%pUb\n", &id[i].uuid);
+		else if (uuid_is_null(&id[i].uuid))
+			seq_printf(m, "%u:%u\n", MAJOR(id[i].dev), MINOR(id[i].dev));
+		else
+			seq_printf(m, "%pUb@%u:%u\n", &id[i].uuid,
+				   MAJOR(id[i].dev), MINOR(id[i].dev));
+	}
+
+	return 0;
+}
+
+static int whitelist_trusted_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, whitelist_trusted_show, NULL);
+}
+
+/*
+ * Add a trusted UUID, block device, or both, or `clear` them all.
+ */
+static ssize_t whitelist_trusted_write(struct file *file, const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	// UUID@MAJOR:MINOR, and a newline.
+	char buffer[UUID_STRING_LEN + 24];
+	char *str;
+	int rc;
+	int i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (count >= sizeof(buffer))
+		return -EINVAL;
+
+	if (copy_from_user(buffer, buf, count))
+		return -EFAULT;
+
+	buffer[count] = '\0';
+	str = strim(buffer);
+
+	if (strcmp(str, "clear") == 0) {
+		spin_lock(&whitelist_trusted_lock);
+		whitelist_trusted_ids = 0;
+		for (i = 0; i < WHITELIST_MAX_TRUSTED; i++)
+			WRITE_ONCE(whitelist_trusted_sb[i], NULL);
+		WRITE_ONCE(whitelist_trusted_sbs, 0);
+		spin_unlock(&whitelist_trusted_lock);
+		return count;
+	}
+
+	rc = whitelist_add_trusted(str);
+	if (rc)
+		return rc;
+
+	// Trust any matching filesystem which is already mounted.
+	iterate_supers(whitelist_trust_existing_sb, NULL);
+	return count;
+}
+
+static const struct file_operations whitelist_trusted_fops = {
+	.open		= whitelist_trusted_open,
+	.read		= seq_read,
+	.write		= whitelist_trusted_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
 };
 
 /*
  * Initialize our module.
  */
-void __init whitelist_add_hooks(void)
+static int __init whitelist_init(void)
 {
+	exec_policy_add_stage(&whitelist_stage);
 	security_add_hooks(whitelist_hooks, ARRAY_SIZE(whitelist_hooks), "whitelist");
 	printk(KERN_INFO "whitelist LSM initialized\n");
+	return 0;
+}
+
+/*
+ * Create our securityfs entries, once securityfs is available.
+ */
+static int __init whitelist_init_securityfs(void)
+{
+	struct dentry *dir;
+	struct dentry *trusted;
+	struct dentry *stats;
+
+	dir = securityfs_create_dir("whitelist", NULL);
+	if (IS_ERR(dir))
+		return PTR_ERR(dir);
+
+	trusted = securityfs_create_file("trusted_mounts", 0600, dir, NULL,
+					 &whitelist_trusted_fops);
+	if (IS_ERR(trusted)) {
+		securityfs_remove(dir);
+		return PTR_ERR(trusted);
+	}
+
+	stats = lsm_stats_create(&whitelist_stats, dir);
+	if (IS_ERR(stats)) {
+		securityfs_remove(trusted);
+		securityfs_remove(dir);
+		return PTR_ERR(stats);
+	}
+
+	return 0;
 }
+fs_initcall(whitelist_init_securityfs);
+
+/*
+ * Ensure the initialization code is called.
+ */
+DEFINE_LSM(whitelist_init) = {
+	.init = whitelist_init,
+	.name = "whitelist",
+};